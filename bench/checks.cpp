@@ -0,0 +1,148 @@
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <mfl/cl/runner.hpp>
+
+// Checks Runner behaviour the other benches do not reach, one scenario per
+// function. Exits with 1 on the first failure. Defaults to CPU devices so it
+// runs on PoCL without a GPU
+//
+//   mfl_cl_checks [--type cpu|gpu|all]
+
+namespace {
+  const char * VALUE_SOURCE = R"(
+#ifndef VALUE
+#define VALUE 1
+#endif
+
+__kernel void value(__global int * out) {
+  out[0] = VALUE;
+}
+)";
+
+  class ValueProgram : public mfl::cl::Program {
+  public:
+    ValueProgram(const std::string & path) :
+        Program(""),
+        mPath(path) {}
+
+    const char * path() const override {
+      return mPath.c_str();
+    }
+
+    const std::string getSource() const override {
+      return VALUE_SOURCE;
+    }
+
+    const char * name() const override {
+      return "value";
+    }
+
+  private:
+    const std::string mPath;
+  };
+
+  void check(bool passed, const std::string & what) {
+    if (!passed) {
+      throw std::runtime_error(what);
+    }
+  }
+
+  // A pooled buffer released while held keeps its block, so the next
+  // allocation of its size class lands somewhere else
+  void heldPooledRelease(mfl::cl::Runner & runner) {
+    runner.enableBufferPool(1 << 20);
+    auto old = runner.createPooledBuffer("old", CL_MEM_READ_WRITE, 4096);
+    auto oldOffset = old.getInfo<CL_MEM_OFFSET>();
+
+    auto hold = runner.holdBuffers({"old"});
+    runner.releaseBuffer("old");
+    auto fresh = runner.createPooledBuffer("new", CL_MEM_READ_WRITE, 4096);
+    check(fresh.getInfo<CL_MEM_OFFSET>() != oldOffset, "Held pooled block was reused");
+
+    hold.reset();
+    runner.releaseBuffer("new");
+  }
+
+  // Binaries of the base program next to its path, built without the
+  // definition, must not stand in for a specialized variant
+  void specializedIgnoresBinaries(mfl::cl::Runner & runner) {
+    const std::string path = "mfl_cl_checks_value";
+    ::cl::Program base(runner.context(), std::string(VALUE_SOURCE));
+    std::vector<::cl::Device> devices;
+    for (auto & info : runner.devices()) {
+      devices.push_back(info.device);
+    }
+    base.build(devices);
+
+    auto sizes = base.getInfo<CL_PROGRAM_BINARY_SIZES>();
+    std::vector<std::string> binaries(sizes.size());
+    std::vector<unsigned char *> pointers(sizes.size());
+    for (std::size_t i = 0; i < sizes.size(); ++i) {
+      binaries[i].resize(sizes[i]);
+      pointers[i] = reinterpret_cast<unsigned char *>(&binaries[i][0]);
+    }
+    clGetProgramInfo(base(),
+                     CL_PROGRAM_BINARIES,
+                     pointers.size() * sizeof(unsigned char *),
+                     pointers.data(),
+                     0);
+
+    std::vector<std::string> files;
+    for (std::size_t i = 0; i < binaries.size(); ++i) {
+      std::string file = path + ".";
+      for (unsigned char c : runner.devices()[i].name) {
+        file += std::isalnum(c) ? static_cast<char>(c) : '_';
+      }
+      file += ".bin";
+      std::ofstream(file, std::ios::binary) << binaries[i];
+      files.push_back(file);
+    }
+
+    ValueProgram program(path);
+    auto kernel = runner.specialize(program, "value", mfl::cl::Define("VALUE", 42));
+    runner.createBuffer("value", CL_MEM_READ_WRITE, sizeof(cl_int));
+    kernel.setArg(0, runner.getBuffer("value"));
+
+    auto queue = runner.commandQueues(1)[0];
+    runner.launch(queue, kernel, ::cl::NDRange(1), ::cl::NDRange(1));
+    cl_int value = 0;
+    queue.enqueueReadBuffer(runner.getBuffer("value"), CL_TRUE, 0, sizeof(value), &value);
+    runner.releaseBuffer("value");
+
+    for (auto & file : files) {
+      std::remove(file.c_str());
+    }
+    check(value == 42, "Specialized program loaded the base binary");
+  }
+}
+
+int main(int argc, char * argv[]) {
+  cl_device_type type = CL_DEVICE_TYPE_CPU;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--type") == 0) {
+      std::string value = argv[i + 1];
+      type = value == "gpu"
+             ? CL_DEVICE_TYPE_GPU
+             : value == "all" ? CL_DEVICE_TYPE_ALL : CL_DEVICE_TYPE_CPU;
+    }
+  }
+
+  try {
+    mfl::cl::Runner runner(type);
+    heldPooledRelease(runner);
+    std::cout << "heldPooledRelease: ok\n";
+    specializedIgnoresBinaries(runner);
+    std::cout << "specializedIgnoresBinaries: ok\n";
+  } catch (std::exception & ex) {
+    std::cerr << ex.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
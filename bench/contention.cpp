@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mfl/cl/runner.hpp>
+
+// Times the Runner's named buffer paths with every thread at once: lookups
+// of a shared set of names through getBuffer, and creation plus release of
+// names private to each thread through createBuffer and releaseBuffer.
+// Defaults to CPU devices so it runs on PoCL without a GPU
+//
+//   mfl_cl_contention [--type cpu|gpu|all]
+
+namespace {
+  constexpr std::size_t NAMES = 1024;
+  constexpr std::size_t LOOKUPS = 1 << 18;
+  constexpr std::size_t CREATIONS = 1 << 10;
+  constexpr std::size_t BYTES = 4096;
+
+  std::vector<std::string> makeNames(const std::string & prefix, std::size_t count) {
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < count; ++i) {
+      names.push_back(prefix + std::to_string(i));
+    }
+    return names;
+  }
+
+  template<typename Work>
+  double run(std::size_t threads, std::size_t operations, Work && work) {
+    std::vector<std::thread> workers;
+    std::exception_ptr failure;
+    std::atomic<bool> failed(false);
+
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t t = 0; t < threads; ++t) {
+      workers.emplace_back([&, t] {
+        try {
+          work(t);
+        } catch (...) {
+          if (!failed.exchange(true)) {
+            failure = std::current_exception();
+          }
+        }
+      });
+    }
+    for (auto & worker : workers) {
+      worker.join();
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (failure) {
+      std::rethrow_exception(failure);
+    }
+    return threads * operations / seconds;
+  }
+}
+
+int main(int argc, char * argv[]) {
+  cl_device_type type = CL_DEVICE_TYPE_CPU;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--type") == 0) {
+      std::string value = argv[i + 1];
+      type = value == "gpu"
+             ? CL_DEVICE_TYPE_GPU
+             : value == "all" ? CL_DEVICE_TYPE_ALL : CL_DEVICE_TYPE_CPU;
+    }
+  }
+
+  try {
+    mfl::cl::Runner runner(type);
+
+    auto shared = makeNames("shared", NAMES);
+    for (auto & name : shared) {
+      runner.createBuffer(name, CL_MEM_READ_WRITE, BYTES);
+    }
+
+    std::printf("%8s %20s %24s\n", "threads", "getBuffer (op/s)", "create+release (op/s)");
+    auto hardware = std::max(std::thread::hardware_concurrency(), 1u);
+    for (std::size_t threads = 1; threads <= hardware; threads *= 2) {
+      auto lookups = run(threads, LOOKUPS, [&](std::size_t t) {
+        std::size_t found = 0;
+        for (std::size_t i = 0; i < LOOKUPS; ++i) {
+          found += runner.getBuffer(shared[(i * 7 + t) % shared.size()])() != nullptr;
+        }
+        if (found != LOOKUPS) {
+          throw std::runtime_error("Lookup returned no buffer");
+        }
+      });
+
+      auto creations = run(threads, CREATIONS, [&](std::size_t t) {
+        auto own = makeNames("thread" + std::to_string(t) + "_", CREATIONS);
+        for (auto & name : own) {
+          runner.createBuffer(name, CL_MEM_READ_WRITE, BYTES);
+        }
+        for (auto & name : own) {
+          runner.releaseBuffer(name);
+        }
+      });
+
+      std::printf("%8zu %20.0f %24.0f\n", threads, lookups, creations);
+    }
+  } catch (std::exception & ex) {
+    std::fprintf(stderr, "%s\n", ex.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <mfl/cl/primitives.hpp>
+#include <mfl/cl/runner.hpp>
+
+// Checks every primitive against its host equivalent and reports device
+// throughput in elements per second. Exits with 1 on the first mismatch.
+// Defaults to CPU devices so it runs on PoCL without a GPU
+//
+//   mfl_cl_primitives [--type cpu|gpu|all] [--size elements]
+
+namespace {
+  typedef std::chrono::steady_clock Clock;
+
+  template<typename F>
+  double seconds(F && f) {
+    auto start = Clock::now();
+    f();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  template<typename T>
+  void upload(mfl::cl::Runner & runner,
+              const ::cl::CommandQueue & queue,
+              const std::string & name,
+              const std::vector<T> & data) {
+    runner.createBuffer(name, CL_MEM_READ_WRITE, data.size() * sizeof(T));
+    queue.enqueueWriteBuffer(runner.getBuffer(name), CL_TRUE, 0, data.size() * sizeof(T), data.data());
+  }
+
+  template<typename T>
+  std::vector<T> download(mfl::cl::Runner & runner,
+                          const ::cl::CommandQueue & queue,
+                          const std::string & name,
+                          std::size_t count) {
+    std::vector<T> data(count);
+    queue.enqueueReadBuffer(runner.getBuffer(name), CL_TRUE, 0, count * sizeof(T), data.data());
+    return data;
+  }
+
+  void check(bool passed, const char * primitive, std::size_t count) {
+    if (!passed) {
+      throw std::runtime_error(std::string(primitive) + " mismatch at " + std::to_string(count) + " elements");
+    }
+  }
+
+  void report(const char * primitive, std::size_t count, double elapsed) {
+    std::cout << primitive << ": " << count / elapsed / 1e6 << " Melements/s (" << count << ")\n";
+  }
+}
+
+int main(int argc, char * argv[]) {
+  cl_device_type type = CL_DEVICE_TYPE_CPU;
+  std::size_t size = std::size_t(1) << 22;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--type") == 0) {
+      std::string value = argv[i + 1];
+      type = value == "gpu"
+             ? CL_DEVICE_TYPE_GPU
+             : value == "all" ? CL_DEVICE_TYPE_ALL : CL_DEVICE_TYPE_CPU;
+    } else if (std::strcmp(argv[i], "--size") == 0) {
+      size = std::stoul(argv[i + 1]);
+    }
+  }
+
+  try {
+    mfl::cl::Runner runner(type);
+    auto queue = runner.commandQueues(1)[0];
+    mfl::cl::Primitives primitives(runner);
+    std::mt19937 random(7);
+    std::cout << runner.devices()[0].name << ", work group " << primitives.workGroupSize() << '\n';
+
+    // Odd sizes exercise partial tiles and the recursive scan
+    for (auto count : {std::size_t(1), std::size_t(1000), std::size_t(77777), size}) {
+      std::vector<std::uint32_t> values(count);
+      for (auto & value : values) {
+        value = random() % 1000;
+      }
+      upload(runner, queue, "values", values);
+      runner.createBuffer("scanned", CL_MEM_READ_WRITE, count * sizeof(std::uint32_t));
+
+      std::uint32_t sum = 0;
+      auto elapsed = seconds([&] {
+        sum = primitives.reduce<std::uint32_t>("values", count);
+      });
+      check(sum == std::accumulate(values.begin(), values.end(), std::uint32_t(0)), "reduce", count);
+      report("reduce", count, elapsed);
+
+      elapsed = seconds([&] {
+        primitives.exclusiveScan<std::uint32_t>("values", "scanned", count);
+      });
+      std::vector<std::uint32_t> expected(count);
+      std::partial_sum(values.begin(), values.end() - 1, expected.begin() + 1);
+      check(download<std::uint32_t>(runner, queue, "scanned", count) == expected, "exclusive_scan", count);
+      report("exclusive_scan", count, elapsed);
+
+      primitives.inclusiveScan<std::uint32_t>("values", "scanned", count);
+      std::partial_sum(values.begin(), values.end(), expected.begin());
+      check(download<std::uint32_t>(runner, queue, "scanned", count) == expected, "inclusive_scan", count);
+
+      std::vector<std::uint32_t> flags(count);
+      std::vector<std::uint32_t> kept;
+      for (std::size_t i = 0; i < count; ++i) {
+        flags[i] = values[i] % 3 == 0;
+        if (flags[i]) {
+          kept.push_back(values[i]);
+        }
+      }
+      upload(runner, queue, "flags", flags);
+      std::size_t compacted = 0;
+      elapsed = seconds([&] {
+        compacted = primitives.compact<std::uint32_t>("values", "flags", "scanned", count);
+      });
+      check(compacted == kept.size()
+            && download<std::uint32_t>(runner, queue, "scanned", compacted) == kept,
+            "compact",
+            count);
+      report("compact", count, elapsed);
+
+      const std::size_t bins = 1000;
+      runner.createBuffer("bins", CL_MEM_READ_WRITE, bins * sizeof(std::uint32_t));
+      elapsed = seconds([&] {
+        primitives.histogram("values", count, "bins", bins);
+      });
+      std::vector<std::uint32_t> counted(bins, 0);
+      for (auto value : values) {
+        ++counted[value];
+      }
+      check(download<std::uint32_t>(runner, queue, "bins", bins) == counted, "histogram", count);
+      report("histogram", count, elapsed);
+
+      for (auto & value : values) {
+        value = random();
+      }
+      queue.enqueueWriteBuffer(runner.getBuffer("values"), CL_TRUE, 0, count * sizeof(std::uint32_t), values.data());
+      elapsed = seconds([&] {
+        primitives.radixSort("values", count);
+      });
+      std::sort(values.begin(), values.end());
+      check(download<std::uint32_t>(runner, queue, "values", count) == values, "radix_sort", count);
+      report("radix_sort", count, elapsed);
+
+      runner.releaseBuffer("values");
+      runner.releaseBuffer("scanned");
+      runner.releaseBuffer("flags");
+      runner.releaseBuffer("bins");
+    }
+
+    // Sums of zeros and ones stay exact in float whatever the order
+    std::vector<float> values(size);
+    for (auto & value : values) {
+      value = static_cast<float>(random() % 2);
+    }
+    upload(runner, queue, "floats", values);
+    float sum = 0;
+    auto elapsed = seconds([&] {
+      sum = primitives.reduce<float>("floats", size);
+    });
+    check(sum == std::accumulate(values.begin(), values.end(), 0.0f), "reduce_float", size);
+    report("reduce_float", size, elapsed);
+  } catch (std::exception & ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#include <mfl/cl/runner.hpp>
+#include <mfl/cl/util.hpp>
+
+// Times the Runner's hot paths and writes the results as JSON, one object
+// per measurement, so runs can be compared across upgrades. Defaults to CPU
+// devices so it runs on PoCL without a GPU
+//
+//   mfl_cl_bench [--type cpu|gpu|all] [--output results.json]
+
+namespace {
+  typedef std::chrono::steady_clock Clock;
+
+  const char * SOURCE = R"(
+__kernel void scale(__global float * data, int factor) {
+  size_t i = get_global_id(0);
+  data[i] = data[i] * factor + SALT;
+}
+)";
+
+  class BenchProgram : public mfl::cl::Program {
+  public:
+    BenchProgram(const std::string & name, int salt) :
+        Program("-D SALT=" + std::to_string(salt)),
+        mName(name) {}
+
+    const char * path() const override {
+      return "";
+    }
+
+    const std::string getSource() const override {
+      return SOURCE;
+    }
+
+    const char * name() const override {
+      return mName.c_str();
+    }
+
+  private:
+    const std::string mName;
+  };
+
+  struct Result {
+    std::string name;
+    std::string unit;
+    double value;
+    std::size_t size;
+  };
+
+  // Created for the binary cache and removed with the entries it holds
+  class ScratchDirectory {
+  public:
+    explicit ScratchDirectory(const std::string & path) :
+        mPath(path) {
+      if (!mfl::cl::util::makeDirectories(mPath)) {
+        throw std::runtime_error("Could not create " + mPath);
+      }
+    }
+
+    ~ScratchDirectory() {
+#ifdef _WIN32
+      _finddata_t entry;
+      auto handle = _findfirst((mPath + "/*").c_str(), &entry);
+      if (handle != -1) {
+        do {
+          std::remove((mPath + "/" + entry.name).c_str());
+        } while (_findnext(handle, &entry) == 0);
+        _findclose(handle);
+      }
+      _rmdir(mPath.c_str());
+#else
+      if (auto directory = opendir(mPath.c_str())) {
+        while (auto entry = readdir(directory)) {
+          std::remove((mPath + "/" + entry->d_name).c_str());
+        }
+        closedir(directory);
+      }
+      rmdir(mPath.c_str());
+#endif
+    }
+
+    const std::string & path() const {
+      return mPath;
+    }
+
+  private:
+    const std::string mPath;
+  };
+
+  template<typename F>
+  double seconds(F && f) {
+    auto start = Clock::now();
+    f();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  // Median of repeated runs, in microseconds
+  template<typename F>
+  double median(std::size_t runs, F && f) {
+    std::vector<double> times;
+    for (std::size_t i = 0; i < runs; ++i) {
+      times.push_back(seconds(f) * 1e6);
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+  }
+
+  std::string escape(const std::string & text) {
+    std::string escaped;
+    for (auto c : text) {
+      if (c == '"' || c == '\\') {
+        escaped += '\\';
+      }
+      if (static_cast<unsigned char>(c) >= 0x20) {
+        escaped += c;
+      }
+    }
+    return escaped;
+  }
+
+  void write(std::ostream & out, const std::string & device, const std::vector<Result> & results) {
+    out << "{\n  \"device\": \"" << escape(device) << "\",\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+      auto & result = results[i];
+      out << "    {\"name\": \"" << result.name
+          << "\", \"unit\": \"" << result.unit
+          << "\", \"value\": " << result.value
+          << ", \"size\": " << result.size
+          << (i + 1 < results.size() ? "},\n" : "}\n");
+    }
+    out << "  ]\n}\n";
+  }
+}
+
+int main(int argc, char * argv[]) {
+  cl_device_type type = CL_DEVICE_TYPE_CPU;
+  std::string output;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--type") == 0) {
+      std::string value = argv[i + 1];
+      type = value == "gpu"
+             ? CL_DEVICE_TYPE_GPU
+             : value == "all" ? CL_DEVICE_TYPE_ALL : CL_DEVICE_TYPE_CPU;
+    } else if (std::strcmp(argv[i], "--output") == 0) {
+      output = argv[i + 1];
+    }
+  }
+
+  std::vector<Result> results;
+  int salt = 0;
+
+  try {
+    results.push_back({"runner_construction", "us", median(5, [type] {
+      mfl::cl::Runner runner(type);
+    }), 0});
+
+    results.push_back({"runner_construction_deferred", "us", median(5, [type] {
+      mfl::cl::Runner runner(mfl::cl::Deferred(), type);
+    }), 0});
+
+    {
+      mfl::cl::Runner deferred(mfl::cl::Deferred(), type);
+      BenchProgram program("first", ++salt);
+      deferred.loadProgram(program);
+      deferred.makeKernel("first", "scale");
+      results.push_back({"time_to_first_kernel", "us", deferred.timeToFirstKernel() / 1e3, 0});
+    }
+
+    mfl::cl::Runner runner(type);
+    auto queue = runner.commandQueues(1)[0];
+    auto device = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_NAME>();
+
+    // Every cold build gets its own options so no driver cache can serve it
+    results.push_back({"load_program_cold", "us", median(5, [&] {
+      BenchProgram program("cold", ++salt);
+      runner.loadProgram(program);
+      runner.releaseProgram("cold");
+    }), 0});
+
+    std::ostringstream name;
+    name << "mfl_cl_bench_cache_" << Clock::now().time_since_epoch().count();
+    ScratchDirectory directory(name.str());
+    runner.enableBinaryCache(directory.path());
+    BenchProgram warm("warm", ++salt);
+    runner.loadProgram(warm);
+    runner.releaseProgram("warm");
+    auto hits = runner.binaryCache()->hits();
+    results.push_back({"load_program_warm", "us", median(5, [&] {
+      runner.loadProgram(warm);
+      runner.releaseProgram("warm");
+    }), 0});
+
+    // A warm load that missed the cache measured a cold build
+    if (runner.binaryCache()->hits() == hits) {
+      throw std::runtime_error("The warm loads missed the binary cache");
+    }
+
+    BenchProgram program("bench", ++salt);
+    runner.loadProgram(program);
+
+    const std::size_t buffers = 1000;
+    auto elapsed = seconds([&] {
+      for (std::size_t i = 0; i < buffers; ++i) {
+        runner.createBuffer("b" + std::to_string(i), CL_MEM_READ_WRITE, std::size_t(4096));
+      }
+      for (std::size_t i = 0; i < buffers; ++i) {
+        runner.releaseBuffer("b" + std::to_string(i));
+      }
+    });
+    results.push_back({"create_release_buffer", "op/s", buffers / elapsed, 4096});
+
+    results.push_back({"make_kernel", "us", median(101, [&] {
+      runner.makeKernel("bench", "scale");
+    }), 0});
+
+    runner.createBuffer("data", CL_MEM_READ_WRITE, std::size_t(1024 * sizeof(float)));
+    auto scale = runner.makeKernelFunctor<::cl::Buffer, int>("bench", "scale");
+    ::cl::make_kernel<::cl::Buffer, int> & raw = scale;
+    auto data = runner.getBuffer("data");
+
+    const std::size_t launches = 10000;
+    elapsed = seconds([&] {
+      for (std::size_t i = 0; i < launches; ++i) {
+        scale(::cl::EnqueueArgs(queue, ::cl::NDRange(1024)), data, 2);
+      }
+    });
+    queue.finish();
+    results.push_back({"launch_enqueue", "us", elapsed * 1e6 / launches, 1024});
+
+    // The same launches without the functor, for its overhead
+    elapsed = seconds([&] {
+      for (std::size_t i = 0; i < launches; ++i) {
+        raw(::cl::EnqueueArgs(queue, ::cl::NDRange(1024)), data, 2);
+      }
+    });
+    queue.finish();
+    results.push_back({"launch_enqueue_raw", "us", elapsed * 1e6 / launches, 1024});
+
+    for (std::size_t size = 4096; size <= std::size_t(64) << 20; size *= 4) {
+      if (size > runner.bufferMemory()) {
+        break;
+      }
+
+      runner.createBuffer("transfer", CL_MEM_READ_WRITE, size);
+      auto transfer = runner.getBuffer("transfer");
+      std::vector<char> host(size, 1);
+
+      auto runs = std::max<std::size_t>(4, (std::size_t(256) << 20) / size);
+      elapsed = seconds([&] {
+        for (std::size_t i = 0; i < runs; ++i) {
+          queue.enqueueWriteBuffer(transfer, CL_TRUE, 0, size, host.data());
+        }
+      });
+      results.push_back({"host_to_device", "GB/s", runs * size / elapsed / 1e9, size});
+
+      elapsed = seconds([&] {
+        for (std::size_t i = 0; i < runs; ++i) {
+          queue.enqueueReadBuffer(transfer, CL_TRUE, 0, size, host.data());
+        }
+      });
+      results.push_back({"device_to_host", "GB/s", runs * size / elapsed / 1e9, size});
+
+      runner.releaseBuffer("transfer");
+    }
+
+    if (output.empty()) {
+      write(std::cout, device, results);
+    } else {
+      std::ofstream file(output);
+      write(file, device, results);
+    }
+  } catch (std::exception & ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,127 @@
+#include "include/mfl/cl/cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include "include/mfl/cl/util.hpp"
+
+namespace mfl {
+  namespace cl {
+
+    namespace {
+      const char MAGIC[] = "MFLCLBIN";
+      const std::size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+      const std::size_t HEADER_SIZE = MAGIC_SIZE + 3 * sizeof(std::uint64_t);
+
+      // Second, independent hash of the key so a file name collision or a
+      // file copied around by hand is detected as stale
+      std::uint64_t keyCheck(const std::string & key) {
+        return util::hash(key, 0x84222325cbf29ce4ull);
+      }
+
+      void append(std::string & data, std::uint64_t value) {
+        char bytes[sizeof(value)];
+        std::memcpy(bytes, &value, sizeof(value));
+        data.append(bytes, sizeof(value));
+      }
+
+      std::uint64_t extract(const std::string & data, std::size_t offset) {
+        std::uint64_t value;
+        std::memcpy(&value, data.data() + offset, sizeof(value));
+        return value;
+      }
+
+      bool decode(const std::string & key,
+                  const std::string & entry,
+                  std::string & binary) {
+        if (entry.size() < HEADER_SIZE
+            || entry.compare(0, MAGIC_SIZE, MAGIC) != 0) {
+          return false;
+        }
+
+        auto check = extract(entry, MAGIC_SIZE);
+        auto size = extract(entry, MAGIC_SIZE + sizeof(std::uint64_t));
+        auto checksum = extract(entry, MAGIC_SIZE + 2 * sizeof(std::uint64_t));
+
+        if (check != keyCheck(key) || size != entry.size() - HEADER_SIZE) {
+          return false;
+        }
+
+        binary = entry.substr(HEADER_SIZE);
+        return util::hash(binary) == checksum;
+      }
+    }
+
+    BinaryCache::BinaryCache(const std::string & directory) :
+        mDirectory(directory),
+        mHits(0),
+        mMisses(0),
+        mStale(0) {}
+
+    std::string BinaryCache::path(const std::string & key) const {
+      char name[17];
+      std::snprintf(name,
+                    sizeof(name),
+                    "%016llx",
+                    static_cast<unsigned long long>(util::hash(key)));
+      return mDirectory + "/" + name + ".clbin";
+    }
+
+    bool BinaryCache::load(const std::vector<std::string> & keys,
+                           std::vector<std::string> & binaries) {
+      binaries.resize(keys.size());
+
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        std::string entry;
+        if (!util::readFile(path(keys[i]), entry)) {
+          mMisses++;
+          return false;
+        }
+
+        if (!decode(keys[i], entry, binaries[i])) {
+          mStale++;
+          mMisses++;
+          return false;
+        }
+      }
+
+      mHits++;
+      return true;
+    }
+
+    bool BinaryCache::store(const std::vector<std::string> & keys,
+                            const std::vector<std::string> & binaries) {
+      if (keys.size() != binaries.size()) {
+        return false;
+      }
+
+      bool stored = true;
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        if (binaries[i].empty()) {
+          stored = false;
+          continue;
+        }
+
+        std::string entry(MAGIC, MAGIC_SIZE);
+        entry.reserve(HEADER_SIZE + binaries[i].size());
+        append(entry, keyCheck(keys[i]));
+        append(entry, binaries[i].size());
+        append(entry, util::hash(binaries[i]));
+        entry += binaries[i];
+
+        stored = util::writeFileAtomically(path(keys[i]), entry) && stored;
+      }
+      return stored;
+    }
+
+    void BinaryCache::reject(const std::vector<std::string> & keys) {
+      for (auto & key : keys) {
+        std::remove(path(key).c_str());
+      }
+
+      mHits--;
+      mMisses++;
+      mStale++;
+    }
+  }
+}
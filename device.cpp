@@ -0,0 +1,133 @@
+#include "include/mfl/cl/device.hpp"
+
+#include <algorithm>
+
+namespace mfl {
+  namespace cl {
+
+    DeviceInfo::DeviceInfo(const ::cl::Device & device) :
+        device(device),
+        name(device.getInfo<CL_DEVICE_NAME>()),
+        vendor(device.getInfo<CL_DEVICE_VENDOR>()),
+        version(device.getInfo<CL_DEVICE_VERSION>()),
+        driver(device.getInfo<CL_DRIVER_VERSION>()),
+        extensions(device.getInfo<CL_DEVICE_EXTENSIONS>()),
+        type(device.getInfo<CL_DEVICE_TYPE>()),
+        computeUnits(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()),
+        clockFrequency(device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>()),
+        vectorWidth(device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>()),
+        globalMemory(device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()),
+        maxAllocation(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()),
+        localMemory(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()),
+        constantMemory(device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>()),
+        alignment(device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8),
+        maxWorkGroupSize(device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()),
+        maxWorkItemSizes(device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>()),
+        queueProperties(device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>()),
+        unifiedMemory(device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() != CL_FALSE) {}
+
+    bool DeviceInfo::supports(const char * extension) const {
+      return extensions.find(extension) != std::string::npos;
+    }
+
+    bool DeviceInfo::supports(const std::vector<const char *> & extensions) const {
+      for (auto extension : extensions) {
+        if (!supports(extension)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    double estimatedThroughput(const DeviceInfo & info) {
+      double lanes = (info.type & CL_DEVICE_TYPE_GPU)
+                     ? 32.0
+                     : std::max<cl_uint>(info.vectorWidth, 1);
+      return lanes * info.computeUnits * info.clockFrequency;
+    }
+
+    std::vector<DeviceInfo> partitionDevices(const std::vector<DeviceInfo> & devices,
+                                             const DevicePartition & partition) {
+      std::vector<DeviceInfo> partitioned;
+      for (auto & info : devices) {
+        cl_device_partition_property properties[3] = {0, 0, 0};
+        if (partition.kind == DevicePartition::NUMA) {
+          properties[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+          properties[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+        } else {
+          properties[0] = CL_DEVICE_PARTITION_EQUALLY;
+          properties[1] = partition.computeUnits;
+        }
+
+        std::vector<::cl::Device> subDevices;
+        try {
+          ::cl::Device(info.device).createSubDevices(properties, &subDevices);
+        } catch (::cl::Error &) {
+          subDevices.clear();
+        }
+
+        if (subDevices.size() > 1) {
+          for (auto & subDevice : subDevices) {
+            partitioned.emplace_back(subDevice);
+          }
+        } else {
+          partitioned.push_back(info);
+        }
+      }
+      return partitioned;
+    }
+
+    int selectDevices(const std::vector<::cl::Platform> & platforms,
+                      cl_device_type type,
+                      const std::vector<const char *> & requirements,
+                      const DeviceScore & score,
+                      std::vector<DeviceInfo> & devices) {
+      int bestIndex = -1;
+      double bestScore = 0;
+      std::vector<std::pair<double, DeviceInfo>> best;
+
+      for (std::size_t i = 0; i < platforms.size(); ++i) {
+        std::vector<::cl::Device> platformDevices;
+        try {
+          platforms[i].getDevices(type, &platformDevices);
+        } catch (::cl::Error &) {
+          continue;
+        }
+
+        double total = 0;
+        std::vector<std::pair<double, DeviceInfo>> candidates;
+        for (auto & device : platformDevices) {
+          DeviceInfo info(device);
+          if (!info.supports(requirements)) {
+            continue;
+          }
+
+          auto value = score(info);
+          if (value > 0) {
+            total += value;
+            candidates.emplace_back(value, std::move(info));
+          }
+        }
+
+        if (total > bestScore) {
+          bestScore = total;
+          bestIndex = static_cast<int>(i);
+          best = std::move(candidates);
+        }
+      }
+
+      std::stable_sort(best.begin(),
+                       best.end(),
+                       [](const std::pair<double, DeviceInfo> & a,
+                          const std::pair<double, DeviceInfo> & b) {
+                         return a.first > b.first;
+                       });
+
+      devices.clear();
+      for (auto & candidate : best) {
+        devices.push_back(std::move(candidate.second));
+      }
+      return bestIndex;
+    }
+  }
+}
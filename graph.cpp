@@ -0,0 +1,470 @@
+#include "include/mfl/cl/graph.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <mfl/exception.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    namespace {
+      // cl_khr_command_buffer entry points; the 1.2 headers predate the
+      // extension, so they are declared here and looked up at run time
+      typedef struct _command_buffer * CommandBufferKHR;
+      typedef cl_uint SyncPointKHR;
+
+      typedef CommandBufferKHR (CL_API_CALL * CreateCommandBufferKHR)(cl_uint,
+                                                                       const cl_command_queue *,
+                                                                       const cl_bitfield *,
+                                                                       cl_int *);
+      typedef cl_int (CL_API_CALL * FinalizeCommandBufferKHR)(CommandBufferKHR);
+      typedef cl_int (CL_API_CALL * ReleaseCommandBufferKHR)(CommandBufferKHR);
+      typedef cl_int (CL_API_CALL * EnqueueCommandBufferKHR)(cl_uint,
+                                                             cl_command_queue *,
+                                                             CommandBufferKHR,
+                                                             cl_uint,
+                                                             const cl_event *,
+                                                             cl_event *);
+      typedef cl_int (CL_API_CALL * CommandNDRangeKernelKHR)(CommandBufferKHR,
+                                                             cl_command_queue,
+                                                             const void *,
+                                                             cl_kernel,
+                                                             cl_uint,
+                                                             const std::size_t *,
+                                                             const std::size_t *,
+                                                             const std::size_t *,
+                                                             cl_uint,
+                                                             const SyncPointKHR *,
+                                                             SyncPointKHR *,
+                                                             void *);
+
+      const cl_device_info DEVICE_COMMAND_BUFFER_CAPABILITIES_KHR = 0x12A9;
+      const cl_bitfield COMMAND_BUFFER_CAPABILITY_SIMULTANEOUS_USE_KHR = 1 << 2;
+      const cl_bitfield COMMAND_BUFFER_FLAGS_KHR = 0x1293;
+      const cl_bitfield COMMAND_BUFFER_SIMULTANEOUS_USE_KHR = 1 << 0;
+
+      template<typename T>
+      T extension(cl_platform_id platform, const char * name) {
+        return reinterpret_cast<T>(clGetExtensionFunctionAddressForPlatform(platform, name));
+      }
+
+      const std::size_t * range(const ::cl::NDRange & range) {
+        return range.dimensions() == 0 ? nullptr : static_cast<const std::size_t *>(range);
+      }
+    }
+
+    struct CommandGraph::NativeGraph {
+      bool supported = false;
+      bool simultaneous = false;
+      bool active = false;
+      CommandBufferKHR buffer = nullptr;
+      ::cl::Event last;
+
+      CreateCommandBufferKHR create = nullptr;
+      FinalizeCommandBufferKHR finalize = nullptr;
+      ReleaseCommandBufferKHR release = nullptr;
+      EnqueueCommandBufferKHR enqueue = nullptr;
+      CommandNDRangeKernelKHR ndRangeKernel = nullptr;
+
+      explicit NativeGraph(const ::cl::CommandQueue & queue) {
+        auto device = queue.getInfo<CL_QUEUE_DEVICE>();
+        if (device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_command_buffer")
+            == std::string::npos) {
+          return;
+        }
+
+        cl_platform_id platform = device.getInfo<CL_DEVICE_PLATFORM>();
+        create = extension<CreateCommandBufferKHR>(platform, "clCreateCommandBufferKHR");
+        finalize = extension<FinalizeCommandBufferKHR>(platform, "clFinalizeCommandBufferKHR");
+        release = extension<ReleaseCommandBufferKHR>(platform, "clReleaseCommandBufferKHR");
+        enqueue = extension<EnqueueCommandBufferKHR>(platform, "clEnqueueCommandBufferKHR");
+        ndRangeKernel = extension<CommandNDRangeKernelKHR>(platform, "clCommandNDRangeKernelKHR");
+        supported = create && finalize && release && enqueue && ndRangeKernel;
+
+        cl_bitfield capabilities = 0;
+        if (clGetDeviceInfo(device(),
+                            DEVICE_COMMAND_BUFFER_CAPABILITIES_KHR,
+                            sizeof(capabilities),
+                            &capabilities,
+                            nullptr) == CL_SUCCESS) {
+          simultaneous = (capabilities & COMMAND_BUFFER_CAPABILITY_SIMULTANEOUS_USE_KHR) != 0;
+        }
+      }
+
+      ~NativeGraph() {
+        reset();
+      }
+
+      // Without simultaneous use a command buffer may not be enqueued again
+      // while its previous submission is pending
+      bool pending() const {
+        if (!last()) {
+          return false;
+        }
+        auto status = last.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+        return status > CL_COMPLETE;
+      }
+
+      // The runtime deletes a released command buffer once its pending
+      // submissions finish, so there is nothing to wait for
+      void reset() {
+        if (buffer) {
+          release(buffer);
+          buffer = nullptr;
+        }
+        last = ::cl::Event();
+      }
+    };
+
+    CommandGraph::CommandGraph(const BufferResolver & resolver) :
+        mResolver(resolver),
+        mOrdered(true) {}
+
+    CommandGraph::CommandGraph(CommandGraph && other) = default;
+
+    CommandGraph::~CommandGraph() = default;
+
+    CommandGraph::Node CommandGraph::launch(const ::cl::Kernel & kernel,
+                                            const ::cl::NDRange & global,
+                                            const ::cl::NDRange & local,
+                                            const ::cl::NDRange & offset,
+                                            const std::vector<Node> & after) {
+      for (auto node : after) {
+        if (node >= mCommands.size()) {
+          throw mfl::Exception::build("Node {} has not been recorded yet", node);
+        }
+      }
+
+      Command command;
+      command.launch = true;
+      command.kernel = kernel;
+      command.global = global;
+      command.local = local;
+      command.offset = offset;
+      command.after = after;
+      mCommands.push_back(std::move(command));
+
+      if (mNative) {
+        mNative->reset();
+      }
+      return mCommands.size() - 1;
+    }
+
+    CommandGraph::Node CommandGraph::copy(const std::string & source,
+                                          const std::string & destination,
+                                          std::size_t size,
+                                          std::size_t sourceOffset,
+                                          std::size_t destinationOffset,
+                                          const std::vector<Node> & after) {
+      for (auto node : after) {
+        if (node >= mCommands.size()) {
+          throw mfl::Exception::build("Node {} has not been recorded yet", node);
+        }
+      }
+
+      Command command;
+      command.launch = false;
+      command.source = source;
+      command.destination = destination;
+      command.size = size;
+      command.sourceOffset = sourceOffset;
+      command.destinationOffset = destinationOffset;
+      command.after = after;
+      mCommands.push_back(std::move(command));
+
+      if (mNative) {
+        mNative->reset();
+      }
+      return mCommands.size() - 1;
+    }
+
+    CommandGraph::Argument & CommandGraph::argument(Node node, cl_uint index) {
+      if (node >= mCommands.size() || !mCommands[node].launch) {
+        throw mfl::Exception::build("Node {} is not a launch in this graph", node);
+      }
+
+      auto & arguments = mCommands[node].arguments;
+      for (auto & argument : arguments) {
+        if (argument.index == index) {
+          return argument;
+        }
+      }
+
+      arguments.push_back(Argument{index, std::vector<char>(0), std::string(), true});
+      return arguments.back();
+    }
+
+    void CommandGraph::setArg(Node node, cl_uint index, const void * value, std::size_t size) {
+      auto & argument = this->argument(node, index);
+      auto bytes = static_cast<const char *>(value);
+      if (argument.buffer.empty()
+          && argument.value.size() == size
+          && std::memcmp(argument.value.data(), bytes, size) == 0) {
+        return;
+      }
+
+      argument.buffer.clear();
+      argument.value.assign(bytes, bytes + size);
+      argument.dirty = true;
+    }
+
+    void CommandGraph::setBuffer(Node node, cl_uint index, const std::string & name) {
+      auto & argument = this->argument(node, index);
+      if (argument.buffer == name) {
+        return;
+      }
+
+      argument.buffer = name;
+      argument.value.clear();
+      argument.dirty = true;
+    }
+
+    void CommandGraph::bind(const std::string & name, const ::cl::Buffer & buffer) {
+      mBuffers[name] = ResolvedBuffer{buffer, nullptr};
+      for (auto & command : mCommands) {
+        for (auto & argument : command.arguments) {
+          if (argument.buffer == name) {
+            argument.dirty = true;
+          }
+        }
+      }
+    }
+
+    void CommandGraph::refresh() {
+      mBuffers.clear();
+      for (auto & command : mCommands) {
+        for (auto & argument : command.arguments) {
+          if (!argument.buffer.empty()) {
+            argument.dirty = true;
+          }
+        }
+      }
+    }
+
+    const ::cl::Buffer & CommandGraph::buffer(const std::string & name) {
+      auto buffer = mBuffers.find(name);
+      if (buffer == mBuffers.end()) {
+        buffer = mBuffers.emplace(name, mResolver(name)).first;
+      }
+      return buffer->second.buffer;
+    }
+
+    bool CommandGraph::apply() {
+      bool changed = false;
+      for (auto & command : mCommands) {
+        for (auto & argument : command.arguments) {
+          if (!argument.dirty) {
+            continue;
+          }
+
+          if (argument.buffer.empty()) {
+            command.kernel.setArg(argument.index, argument.value.size(), argument.value.data());
+          } else {
+            command.kernel.setArg(argument.index, buffer(argument.buffer));
+          }
+          argument.dirty = false;
+          changed = true;
+        }
+      }
+      return changed;
+    }
+
+    bool CommandGraph::native() const {
+      return mNative && mNative->active;
+    }
+
+    bool CommandGraph::replayNative(const ::cl::CommandQueue & queue,
+                                    const std::vector<::cl::Event> * events,
+                                    ::cl::Event * event,
+                                    bool changed) {
+      if (!mNative) {
+        mNative.reset(new NativeGraph(queue));
+      }
+
+      auto & native = *mNative;
+      native.active = false;
+      if (!native.supported) {
+        return false;
+      }
+
+      // Without mutable dispatch the arguments are baked into the recording
+      if (changed) {
+        native.reset();
+      }
+
+      // Replayed through the queue rather than waiting on the host
+      if (!native.simultaneous && native.pending()) {
+        return false;
+      }
+
+      cl_int error;
+      if (!native.buffer) {
+        cl_command_queue handle = queue();
+        cl_bitfield properties[] = {
+          COMMAND_BUFFER_FLAGS_KHR, COMMAND_BUFFER_SIMULTANEOUS_USE_KHR, 0
+        };
+        native.buffer = native.create(1,
+                                      &handle,
+                                      native.simultaneous ? properties : nullptr,
+                                      &error);
+        if (error != CL_SUCCESS) {
+          native.buffer = nullptr;
+          throw ::cl::Error(error, "clCreateCommandBufferKHR");
+        }
+
+        std::vector<SyncPointKHR> points(mCommands.size());
+        std::vector<SyncPointKHR> wait;
+        for (std::size_t i = 0; i < mCommands.size(); ++i) {
+          auto & command = mCommands[i];
+          wait.clear();
+          for (auto node : command.after) {
+            wait.push_back(points[node]);
+          }
+
+          error = native.ndRangeKernel(native.buffer,
+                                       nullptr,
+                                       nullptr,
+                                       command.kernel(),
+                                       static_cast<cl_uint>(command.global.dimensions()),
+                                       range(command.offset),
+                                       range(command.global),
+                                       range(command.local),
+                                       static_cast<cl_uint>(wait.size()),
+                                       wait.empty() ? nullptr : wait.data(),
+                                       &points[i],
+                                       nullptr);
+          if (error != CL_SUCCESS) {
+            native.reset();
+            throw ::cl::Error(error, "clCommandNDRangeKernelKHR");
+          }
+        }
+
+        error = native.finalize(native.buffer);
+        if (error != CL_SUCCESS) {
+          native.reset();
+          throw ::cl::Error(error, "clFinalizeCommandBufferKHR");
+        }
+      }
+
+      std::vector<cl_event> wait;
+      for (auto & waitEvent : roots(events)) {
+        wait.push_back(waitEvent());
+      }
+
+      cl_event done;
+      error = native.enqueue(0,
+                             nullptr,
+                             native.buffer,
+                             static_cast<cl_uint>(wait.size()),
+                             wait.empty() ? nullptr : wait.data(),
+                             &done);
+      if (error != CL_SUCCESS) {
+        throw ::cl::Error(error, "clEnqueueCommandBufferKHR");
+      }
+
+      native.last = ::cl::Event(done);
+      native.active = true;
+      if (!mOrdered) {
+        mLast = native.last;
+      }
+      if (event) {
+        *event = native.last;
+      }
+      return true;
+    }
+
+    const std::vector<::cl::Event> & CommandGraph::roots(const std::vector<::cl::Event> * events) {
+      mRoots.clear();
+      if (events) {
+        mRoots = *events;
+      }
+      if (mLast()) {
+        mRoots.push_back(mLast);
+      }
+      return mRoots;
+    }
+
+    void CommandGraph::replay(const ::cl::CommandQueue & queue,
+                              const std::vector<::cl::Event> * events,
+                              ::cl::Event * event) {
+      bool changed = apply();
+
+      if (mQueue() != queue()) {
+        mQueue = queue;
+        mOrdered = !(queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+        mNative.reset();
+      }
+
+      bool launches = std::all_of(mCommands.begin(),
+                                  mCommands.end(),
+                                  [](const Command & command) {
+                                    return command.launch;
+                                  });
+      if (launches
+          && !mCommands.empty()
+          && replayNative(queue, events, event, changed)) {
+        return;
+      }
+
+      if (mCommands.empty()) {
+        if (event) {
+          queue.enqueueMarkerWithWaitList(events, event);
+        }
+        return;
+      }
+
+      // In order queues only need the external events on the first command
+      // and an event on the last; out of order queues follow the recorded
+      // dependencies, with the roots also waiting on the previous replay
+      if (!mOrdered) {
+        events = &roots(events);
+      }
+      mEvents.resize(mCommands.size());
+      for (std::size_t i = 0; i < mCommands.size(); ++i) {
+        auto & command = mCommands[i];
+
+        const std::vector<::cl::Event> * wait = nullptr;
+        if (mOrdered) {
+          wait = i == 0 ? events : nullptr;
+        } else if (command.after.empty()) {
+          wait = events;
+        } else {
+          command.wait.clear();
+          for (auto node : command.after) {
+            command.wait.push_back(mEvents[node]);
+          }
+          wait = &command.wait;
+        }
+
+        ::cl::Event * signal = !mOrdered || (event && i + 1 == mCommands.size())
+                               ? &mEvents[i]
+                               : nullptr;
+
+        if (command.launch) {
+          queue.enqueueNDRangeKernel(command.kernel,
+                                     command.offset,
+                                     command.global,
+                                     command.local,
+                                     wait,
+                                     signal);
+        } else {
+          queue.enqueueCopyBuffer(buffer(command.source),
+                                  buffer(command.destination),
+                                  command.sourceOffset,
+                                  command.destinationOffset,
+                                  command.size,
+                                  wait,
+                                  signal);
+        }
+      }
+
+      if (!mOrdered) {
+        queue.enqueueMarkerWithWaitList(&mEvents, &mLast);
+      }
+      if (event) {
+        *event = mOrdered ? mEvents.back() : mLast;
+      }
+    }
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace mfl {
+  namespace cl {
+
+    class BinaryCache {
+    public:
+      BinaryCache(const std::string & directory);
+
+      // All-or-nothing: succeeds only if every key has a valid entry
+      bool load(const std::vector<std::string> & keys,
+                std::vector<std::string> & binaries);
+
+      bool store(const std::vector<std::string> & keys,
+                 const std::vector<std::string> & binaries);
+
+      // Drops entries the driver refused, turning the last hit into a miss
+      void reject(const std::vector<std::string> & keys);
+
+      const std::string & directory() const {
+        return mDirectory;
+      }
+
+      std::size_t hits() const {
+        return mHits;
+      }
+
+      std::size_t misses() const {
+        return mMisses;
+      }
+
+      std::size_t stale() const {
+        return mStale;
+      }
+
+    private:
+      std::string path(const std::string & key) const;
+
+      const std::string mDirectory;
+
+      std::atomic<std::size_t> mHits;
+      std::atomic<std::size_t> mMisses;
+      std::atomic<std::size_t> mStale;
+    };
+  }
+}
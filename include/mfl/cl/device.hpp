@@ -0,0 +1,75 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    // Capabilities of a device, queried once
+    struct DeviceInfo {
+      explicit DeviceInfo(const ::cl::Device & device);
+
+      bool supports(const char * extension) const;
+
+      bool supports(const std::vector<const char *> & extensions) const;
+
+      ::cl::Device device;
+      std::string name;
+      std::string vendor;
+      std::string version;
+      std::string driver;
+      std::string extensions;
+      cl_device_type type;
+      cl_uint computeUnits;
+      // MHz
+      cl_uint clockFrequency;
+      cl_uint vectorWidth;
+      std::size_t globalMemory;
+      std::size_t maxAllocation;
+      std::size_t localMemory;
+      std::size_t constantMemory;
+      std::size_t alignment;
+      std::size_t maxWorkGroupSize;
+      std::vector<std::size_t> maxWorkItemSizes;
+      cl_command_queue_properties queueProperties;
+      bool unifiedMemory;
+    };
+
+    struct DevicePartition {
+      enum Kind {
+        // One sub-device per NUMA node
+        NUMA,
+        // Sub-devices of computeUnits compute units each
+        EQUALLY
+      };
+
+      Kind kind;
+      cl_uint computeUnits;
+    };
+
+    // Devices that cannot be split as asked come back whole
+    std::vector<DeviceInfo> partitionDevices(const std::vector<DeviceInfo> & devices,
+                                             const DevicePartition & partition);
+
+    // Devices scoring zero or less are left out
+    typedef std::function<double(const DeviceInfo & info)> DeviceScore;
+
+    // Peak lanes times clock. Compute units do not report their width, so
+    // GPUs are assumed 32 lanes wide and CPUs as wide as their float vectors
+    double estimatedThroughput(const DeviceInfo & info);
+
+    // Picks the platform whose compatible devices score highest in total and
+    // fills devices with those, best first. Returns the platform index, or
+    // -1 when no platform has a compatible device
+    int selectDevices(const std::vector<::cl::Platform> & platforms,
+                      cl_device_type type,
+                      const std::vector<const char *> & requirements,
+                      const DeviceScore & score,
+                      std::vector<DeviceInfo> & devices);
+  }
+}
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <mfl/exception.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    template<typename T>
+    class Future;
+
+    template<typename T>
+    class Promise;
+
+    namespace detail {
+      template<typename R, typename = void>
+      struct Settle;
+    }
+
+    class FutureStateBase {
+    public:
+      // Runs store and the continuations once; later calls are ignored
+      template<typename Store>
+      void settle(Store && store) {
+        std::vector<std::function<void()>> continuations;
+        {
+          std::lock_guard<std::mutex> lock(mMutex);
+          if (mReady) {
+            return;
+          }
+          store();
+          mReady = true;
+          continuations.swap(mContinuations);
+        }
+        mCondition.notify_all();
+
+        for (auto & continuation : continuations) {
+          continuation();
+        }
+      }
+
+      void fail(std::exception_ptr error) {
+        settle([&] { mError = error; });
+      }
+
+      // Runs continuation right away when already settled
+      void subscribe(std::function<void()> continuation) {
+        {
+          std::lock_guard<std::mutex> lock(mMutex);
+          if (!mReady) {
+            mContinuations.push_back(std::move(continuation));
+            return;
+          }
+        }
+        continuation();
+      }
+
+      bool ready() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mReady;
+      }
+
+      void wait() const {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait(lock, [this] { return mReady; });
+      }
+
+    protected:
+      void rethrow() const {
+        if (mError) {
+          std::rethrow_exception(mError);
+        }
+      }
+
+    private:
+      mutable std::mutex mMutex;
+      mutable std::condition_variable mCondition;
+      bool mReady = false;
+      std::exception_ptr mError;
+      std::vector<std::function<void()>> mContinuations;
+    };
+
+    template<typename T>
+    class FutureState : public FutureStateBase {
+    public:
+      typedef const T & Result;
+
+      template<typename ... V>
+      void store(V && ... value) {
+        mValue.reset(new T(std::forward<V>(value)...));
+      }
+
+      Result result() const {
+        rethrow();
+        return *mValue;
+      }
+
+    private:
+      std::unique_ptr<T> mValue;
+    };
+
+    template<>
+    class FutureState<void> : public FutureStateBase {
+    public:
+      typedef void Result;
+
+      void store() {}
+
+      Result result() const {
+        rethrow();
+      }
+    };
+
+    namespace detail {
+      template<typename T>
+      struct FutureValue {
+        typedef T type;
+      };
+
+      template<typename T>
+      struct FutureValue<Future<T>> {
+        typedef T type;
+      };
+    }
+
+    // Completed from whichever thread settles its promise, usually the
+    // driver's event callback thread. Continuations run on that thread and
+    // must not block on device work. Default constructed futures are not
+    // valid, and throw from everything but valid
+    template<typename T>
+    class Future {
+    public:
+      Future() = default;
+
+      bool valid() const {
+        return static_cast<bool>(mState);
+      }
+
+      bool ready() const {
+        return state().ready();
+      }
+
+      void wait() const {
+        state().wait();
+      }
+
+      // Blocks, and rethrows the error the operation failed with
+      typename FutureState<T>::Result get() const {
+        state().wait();
+        return state().result();
+      }
+
+      // The continuation receives this future, settled, and returns a value
+      // or another future to chain on. Exceptions it throws fail the result
+      template<typename F>
+      Future<typename detail::FutureValue<typename std::result_of<F(const Future<T> &)>::type>::type>
+      then(F && continuation) const;
+
+    private:
+      template<typename>
+      friend class Future;
+
+      template<typename>
+      friend class Promise;
+
+      template<typename, typename>
+      friend struct detail::Settle;
+
+      explicit Future(const std::shared_ptr<FutureState<T>> & state) :
+          mState(state) {}
+
+      FutureState<T> & state() const {
+        if (!mState) {
+          throw mfl::Exception::build("The future has no state");
+        }
+        return *mState;
+      }
+
+      std::shared_ptr<FutureState<T>> mState;
+    };
+
+    template<typename T>
+    class Promise {
+    public:
+      Promise() :
+          mState(std::make_shared<FutureState<T>>()) {}
+
+      Future<T> future() const {
+        return Future<T>(mState);
+      }
+
+      template<typename ... V>
+      void setValue(V && ... value) {
+        auto state = mState.get();
+        mState->settle([&] { state->store(std::forward<V>(value)...); });
+      }
+
+      void setException(std::exception_ptr error) {
+        mState->fail(error);
+      }
+
+    private:
+      std::shared_ptr<FutureState<T>> mState;
+    };
+
+    namespace detail {
+      // Settles promise with what the continuation returns for the settled
+      // future, following returned futures
+      template<typename R, typename>
+      struct Settle {
+        template<typename T, typename F>
+        static void apply(Promise<R> & promise, F & continuation, const Future<T> & future) {
+          promise.setValue(continuation(future));
+        }
+      };
+
+      template<typename V>
+      struct Settle<void, V> {
+        template<typename T, typename F>
+        static void apply(Promise<void> & promise, F & continuation, const Future<T> & future) {
+          continuation(future);
+          promise.setValue();
+        }
+      };
+
+      template<typename U>
+      struct Forward {
+        static void apply(Promise<U> & promise, const Future<U> & inner) {
+          promise.setValue(inner.get());
+        }
+      };
+
+      template<>
+      struct Forward<void> {
+        static void apply(Promise<void> & promise, const Future<void> & inner) {
+          inner.get();
+          promise.setValue();
+        }
+      };
+
+      template<typename U, typename V>
+      struct Settle<Future<U>, V> {
+        template<typename T, typename F>
+        static void apply(Promise<U> & promise, F & continuation, const Future<T> & future) {
+          auto inner = continuation(future);
+          auto chained = std::make_shared<Promise<U>>(promise);
+          inner.state().subscribe([chained, inner] {
+            try {
+              Forward<U>::apply(*chained, inner);
+            } catch (...) {
+              chained->setException(std::current_exception());
+            }
+          });
+        }
+      };
+    }
+
+    template<typename T>
+    template<typename F>
+    Future<typename detail::FutureValue<typename std::result_of<F(const Future<T> &)>::type>::type>
+    Future<T>::then(F && continuation) const {
+      typedef typename std::result_of<F(const Future<T> &)>::type R;
+      typedef typename detail::FutureValue<R>::type U;
+
+      Promise<U> promise;
+      auto self = *this;
+      auto function = std::make_shared<typename std::decay<F>::type>(std::forward<F>(continuation));
+      state().subscribe([promise, self, function]() mutable {
+        try {
+          detail::Settle<R>::apply(promise, *function, self);
+        } catch (...) {
+          promise.setException(std::current_exception());
+        }
+      });
+      return promise.future();
+    }
+
+    // Completes once every future has; fails with the first error seen
+    template<typename T>
+    Future<void> whenAll(const std::vector<Future<T>> & futures) {
+      struct Join {
+        std::atomic<std::size_t> remaining;
+        std::mutex mutex;
+        std::exception_ptr error;
+        Promise<void> promise;
+      };
+
+      auto join = std::make_shared<Join>();
+      join->remaining = futures.size();
+      auto result = join->promise.future();
+      if (futures.empty()) {
+        join->promise.setValue();
+        return result;
+      }
+
+      for (auto & future : futures) {
+        future.then([join](const Future<T> & done) {
+          try {
+            done.get();
+          } catch (...) {
+            std::lock_guard<std::mutex> lock(join->mutex);
+            if (!join->error) {
+              join->error = std::current_exception();
+            }
+          }
+
+          if (--join->remaining == 0) {
+            if (join->error) {
+              join->promise.setException(join->error);
+            } else {
+              join->promise.setValue();
+            }
+          }
+        });
+      }
+      return result;
+    }
+  }
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    // A resolved buffer, along with whatever keeps it valid while held
+    struct ResolvedBuffer {
+      ::cl::Buffer buffer;
+      std::shared_ptr<void> hold;
+    };
+
+    typedef std::function<ResolvedBuffer(const std::string & name)> BufferResolver;
+
+    // A fixed sequence of launches and copies, recorded once and replayed
+    // many times. Kernel arguments are only set again when they change, and
+    // graphs made of launches alone are submitted as a single command buffer
+    // on devices with cl_khr_command_buffer
+    class CommandGraph {
+    public:
+      typedef std::size_t Node;
+
+      explicit CommandGraph(const BufferResolver & resolver);
+
+      CommandGraph(CommandGraph && other);
+
+      ~CommandGraph();
+
+      // Every launch needs a kernel object of its own, since arguments stay
+      // set on it between replays. Arguments set on the kernel before
+      // recording are kept as they are
+      Node launch(const ::cl::Kernel & kernel,
+                  const ::cl::NDRange & global,
+                  const ::cl::NDRange & local = ::cl::NullRange,
+                  const ::cl::NDRange & offset = ::cl::NullRange,
+                  const std::vector<Node> & after = std::vector<Node>(0));
+
+      Node copy(const std::string & source,
+                const std::string & destination,
+                std::size_t size,
+                std::size_t sourceOffset = 0,
+                std::size_t destinationOffset = 0,
+                const std::vector<Node> & after = std::vector<Node>(0));
+
+      template<typename T>
+      void setArg(Node node, cl_uint index, const T & value) {
+        setArg(node, index, &value, sizeof(T));
+      }
+
+      void setArg(Node node, cl_uint index, const void * value, std::size_t size);
+
+      // The named buffer is resolved on the first replay and held until it
+      // is rebound or the graph is refreshed
+      void setBuffer(Node node, cl_uint index, const std::string & name);
+
+      void bind(const std::string & name, const ::cl::Buffer & buffer);
+
+      // Resolves every named buffer again on the next replay
+      void refresh();
+
+      // Commands wait on events before running; event completes when the
+      // whole graph has. Successive replays on one queue run in order, out
+      // of order queues included, without blocking the host
+      void replay(const ::cl::CommandQueue & queue,
+                  const std::vector<::cl::Event> * events = nullptr,
+                  ::cl::Event * event = nullptr);
+
+      std::size_t size() const {
+        return mCommands.size();
+      }
+
+      // Whether the last replay went through a native command buffer
+      bool native() const;
+
+    private:
+      struct Argument {
+        cl_uint index;
+        std::vector<char> value;
+        std::string buffer;
+        bool dirty;
+      };
+
+      struct Command {
+        bool launch;
+        ::cl::Kernel kernel;
+        ::cl::NDRange global;
+        ::cl::NDRange local;
+        ::cl::NDRange offset;
+        std::string source;
+        std::string destination;
+        std::size_t size;
+        std::size_t sourceOffset;
+        std::size_t destinationOffset;
+        std::vector<Node> after;
+        std::vector<Argument> arguments;
+        std::vector<::cl::Event> wait;
+      };
+
+      struct NativeGraph;
+
+      Argument & argument(Node node, cl_uint index);
+      const ::cl::Buffer & buffer(const std::string & name);
+      bool apply();
+      // The external events plus the previous replay on out of order queues
+      const std::vector<::cl::Event> & roots(const std::vector<::cl::Event> * events);
+      bool replayNative(const ::cl::CommandQueue & queue,
+                        const std::vector<::cl::Event> * events,
+                        ::cl::Event * event,
+                        bool changed);
+
+      BufferResolver mResolver;
+      ::cl::CommandQueue mQueue;
+      bool mOrdered;
+      std::vector<Command> mCommands;
+      std::unordered_map<std::string, ResolvedBuffer> mBuffers;
+      std::vector<::cl::Event> mEvents;
+      std::vector<::cl::Event> mRoots;
+      ::cl::Event mLast;
+      std::unique_ptr<NativeGraph> mNative;
+    };
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include "profiler.hpp"
+
+namespace mfl {
+  namespace cl {
+
+    template<typename ... T>
+    class KernelFunctor {
+    public:
+      KernelFunctor(const ::cl::Program & program,
+                    const std::string & name,
+                    const std::shared_ptr<Profiler> & profiler) :
+          mFunctor(program, name),
+          mName(name),
+          mProfiler(profiler) {}
+
+      ::cl::Event operator()(const ::cl::EnqueueArgs & args, T ... ts) {
+        if (!mProfiler) {
+          return mFunctor(args, ts...);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto event = mFunctor(args, ts...);
+        mProfiler->record(mName,
+                          event,
+                          std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - start).count());
+        return event;
+      }
+
+      operator ::cl::make_kernel<T...> &() {
+        return mFunctor;
+      }
+
+      const std::string & name() const {
+        return mName;
+      }
+
+    private:
+      ::cl::make_kernel<T...> mFunctor;
+      std::string mName;
+      std::shared_ptr<Profiler> mProfiler;
+    };
+  }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    struct PoolStatistics {
+      std::size_t reserved;
+      std::size_t allocated;
+      std::size_t requested;
+      std::size_t highWaterMark;
+      std::size_t blocks;
+      std::size_t slabs;
+
+      // Share of the handed out bytes lost to size class rounding
+      double internalFragmentation() const {
+        return allocated == 0 ? 0.0 : 1.0 - double(requested) / allocated;
+      }
+
+      // Share of the reserved bytes sitting in free lists
+      double externalFragmentation() const {
+        return reserved == 0 ? 0.0 : 1.0 - double(allocated) / reserved;
+      }
+    };
+
+    // Power-of-two size classes carved out of large backing buffers.
+    // Blocks released with a reusable check stay out of the free lists, and
+    // counted as allocated, until the check passes on a later allocation;
+    // the others are recycled at once
+    class BufferPool {
+    public:
+      struct Block {
+        std::size_t sizeClass;
+        std::size_t slab;
+        std::size_t offset;
+        std::size_t size;
+      };
+
+      // slabSize is rounded down to a power of two, so slabs never exceed it
+      BufferPool(const ::cl::Context & context,
+                 std::size_t alignment,
+                 std::size_t slabSize);
+
+      ::cl::Buffer allocate(cl_mem_flags flags, std::size_t size, Block & block);
+
+      // reusable tells whether every command using the block has finished
+      void release(const Block & block, const std::function<bool()> & reusable = nullptr);
+
+      PoolStatistics statistics() const;
+
+      std::size_t slabSize() const {
+        return mSlabSize;
+      }
+
+    private:
+      struct SizeClass {
+        std::vector<::cl::Buffer> slabs;
+        std::vector<std::pair<std::size_t, std::size_t>> free;
+      };
+
+      struct Retired {
+        Block block;
+        std::function<bool()> reusable;
+      };
+
+      std::size_t blockSize(std::size_t sizeClass) const {
+        return mMinimumBlock << sizeClass;
+      }
+
+      // Expect the lock to be held
+      void recycle(const Block & block);
+      void reclaim();
+
+      const ::cl::Context mContext;
+      const std::size_t mMinimumBlock;
+      const std::size_t mSlabSize;
+
+      mutable std::mutex mMutex;
+      std::vector<SizeClass> mClasses;
+      std::vector<Retired> mRetired;
+      PoolStatistics mStatistics;
+    };
+  }
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include "program.hpp"
+
+namespace mfl {
+  namespace cl {
+
+    class Runner;
+
+    template<typename T>
+    struct PrimitiveType;
+
+    template<>
+    struct PrimitiveType<float> {
+      static const char * name() {
+        return "float";
+      }
+    };
+
+    template<>
+    struct PrimitiveType<double> {
+      static const char * name() {
+        return "double";
+      }
+    };
+
+    template<>
+    struct PrimitiveType<std::int32_t> {
+      static const char * name() {
+        return "int";
+      }
+    };
+
+    template<>
+    struct PrimitiveType<std::uint32_t> {
+      static const char * name() {
+        return "uint";
+      }
+    };
+
+    template<>
+    struct PrimitiveType<std::int64_t> {
+      static const char * name() {
+        return "long";
+      }
+    };
+
+    template<>
+    struct PrimitiveType<std::uint64_t> {
+      static const char * name() {
+        return "ulong";
+      }
+    };
+
+    class PrimitivesProgram : public Program {
+    public:
+      PrimitivesProgram() :
+          Program("") {}
+
+      const char * path() const override {
+        return "";
+      }
+
+      const std::string getSource() const override;
+
+      const char * name() const override {
+        return "mfl_cl_primitives";
+      }
+    };
+
+    // Reduce, scan, compaction, radix sort and histogram over named Runner
+    // buffers, on one device. Variants are built per element type and work
+    // group size through Runner::specialize on first use. Calls block until
+    // their result is ready and are serialized per instance. The queue and
+    // kernels are made again when the Runner's context changes, as after
+    // Runner::partition
+    class Primitives {
+    public:
+      explicit Primitives(Runner & runner, std::size_t device = 0);
+
+      template<typename T>
+      T reduce(const std::string & input, std::size_t count) {
+        T result;
+        reduce(PrimitiveType<T>::name(), sizeof(T), input, count, &result);
+        return result;
+      }
+
+      template<typename T>
+      void exclusiveScan(const std::string & input, const std::string & output, std::size_t count) {
+        scan(PrimitiveType<T>::name(), sizeof(T), input, output, count, false);
+      }
+
+      template<typename T>
+      void inclusiveScan(const std::string & input, const std::string & output, std::size_t count) {
+        scan(PrimitiveType<T>::name(), sizeof(T), input, output, count, true);
+      }
+
+      // Packs the elements whose uint flag is non-zero into output, in
+      // order, and returns how many there were
+      template<typename T>
+      std::size_t compact(const std::string & input,
+                          const std::string & flags,
+                          const std::string & output,
+                          std::size_t count) {
+        return compact(PrimitiveType<T>::name(), input, flags, output, count);
+      }
+
+      // Sorts uint keys in place, four bits per pass
+      void radixSort(const std::string & keys, std::size_t count);
+
+      // Counts uint values into bins; values past the last bin are ignored
+      void histogram(const std::string & input,
+                     std::size_t count,
+                     const std::string & bins,
+                     std::size_t binCount);
+
+      std::size_t workGroupSize() const {
+        return mWorkGroupSize;
+      }
+
+    private:
+      // Sizes work groups for the device and makes the queue on the
+      // Runner's current context
+      void bind();
+
+      void refresh();
+
+      ::cl::Kernel & kernel(const std::string & name, const char * type);
+
+      ::cl::Buffer temporary(std::size_t bytes);
+
+      // Submits through the Runner run on other queues, so their commands on
+      // the named buffers have to finish before the first launch here
+      void await(const std::vector<std::string> & names) const;
+
+      void run(const ::cl::Kernel & kernel, std::size_t global, std::size_t local);
+
+      void reduce(const char * type,
+                  std::size_t size,
+                  const std::string & input,
+                  std::size_t count,
+                  void * result);
+
+      void scan(const char * type,
+                std::size_t size,
+                const std::string & input,
+                const std::string & output,
+                std::size_t count,
+                bool inclusive);
+
+      void scan(const char * type,
+                std::size_t size,
+                const ::cl::Buffer & input,
+                const ::cl::Buffer & output,
+                std::size_t count,
+                bool inclusive);
+
+      std::size_t compact(const char * type,
+                          const std::string & input,
+                          const std::string & flags,
+                          const std::string & output,
+                          std::size_t count);
+
+      Runner & mRunner;
+      const std::size_t mDevice;
+      const PrimitivesProgram mProgram;
+      ::cl::Context mContext;
+      ::cl::CommandQueue mQueue;
+      std::size_t mWorkGroupSize;
+      std::size_t mGroups;
+      std::size_t mLocalMemory;
+
+      std::mutex mMutex;
+      std::unordered_map<std::string, ::cl::Kernel> mKernels;
+    };
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    // All times in nanoseconds
+    struct KernelStatistics {
+      std::string name;
+      std::size_t count;
+      std::uint64_t p50;
+      std::uint64_t p99;
+      std::uint64_t totalDevice;
+      std::uint64_t totalQueued;
+      std::uint64_t totalSubmitted;
+      std::uint64_t totalEnqueue;
+    };
+
+    class Profiler {
+    public:
+      void record(const std::string & kernel,
+                  const ::cl::Event & event,
+                  std::uint64_t enqueueNanoseconds);
+
+      // Folds every completed launch into the histograms before reporting
+      std::vector<KernelStatistics> statistics();
+
+      std::size_t pending() const;
+
+      void reset();
+
+    private:
+      // Log-linear buckets: 16 linear steps per power of two
+      class Histogram {
+      public:
+        Histogram() : mBuckets() {}
+
+        void add(std::uint64_t value);
+
+        std::uint64_t percentile(double fraction) const;
+
+      private:
+        static const std::size_t SUB_BUCKETS = 16;
+
+        std::array<std::uint32_t, 61 * SUB_BUCKETS> mBuckets;
+      };
+
+      struct Pending {
+        std::string kernel;
+        ::cl::Event event;
+        std::uint64_t enqueue;
+      };
+
+      struct Entry {
+        Histogram device;
+        std::size_t count;
+        std::uint64_t totalDevice;
+        std::uint64_t totalQueued;
+        std::uint64_t totalSubmitted;
+        std::uint64_t totalEnqueue;
+      };
+
+      void collect();
+
+      mutable std::mutex mMutex;
+      std::vector<Pending> mPending;
+      std::unordered_map<std::string, Entry> mKernels;
+    };
+  }
+}
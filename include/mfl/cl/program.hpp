@@ -1,14 +1,51 @@
 ﻿#pragma once
 
+#include <sys/stat.h>
+
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace mfl {
   namespace cl {
 
+    // Code shared between programs, compiled once per Runner and linked into
+    // each program listing it. The module and those programs see its header
+    // as #include "<name>"
+    class Module {
+    public:
+      Module(const std::string & buildString) :
+          mBuildString(buildString) {};
+
+      virtual ~Module() = default;
+
+      const char * buildString() const {
+        return mBuildString.c_str();
+      }
+
+      virtual const char * name() const = 0;
+
+      // Declarations for the programs using the module
+      virtual const std::string getHeader() const {
+        return "";
+      };
+
+      virtual const std::string getSource() const = 0;
+
+    private:
+      const std::string mBuildString;
+    };
+
     class Program {
     public:
       Program(const std::string & buildString) :
-          mBuildString(buildString) {};
+          mBuildString(buildString),
+          mFiles(std::make_shared<Files>()) {};
 
       virtual ~Program() = default;
 
@@ -24,8 +61,72 @@ namespace mfl {
 
       virtual const char * name() const = 0;
 
+      // Linked in when the program is built from source, which is then
+      // compiled with the build string and every module's header
+      virtual std::vector<const Module *> modules() const {
+        return std::vector<const Module *>(0);
+      }
+
+      // SPIR-V compiled offline, read from path() + ".spv" when present
+      virtual const std::string getIL() const {
+        return readAlongside(".spv");
+      }
+
+      // Binary compiled offline for the named device, read from
+      // path() + "." + device + ".bin" with the name reduced to [A-Za-z0-9_]
+      virtual const std::string getBinary(const std::string & device) const {
+        std::string suffix = ".";
+        for (unsigned char c : device) {
+          suffix += std::isalnum(c) ? static_cast<char>(c) : '_';
+        }
+        return readAlongside(suffix + ".bin");
+      }
+
+    protected:
+      // Read again only when the file's size or modification time changed
+      const std::string readAlongside(const std::string & suffix) const {
+        auto base = path();
+        if (!base || !*base) {
+          return "";
+        }
+
+        std::string name = std::string(base) + suffix;
+        struct stat info;
+        if (stat(name.c_str(), &info) != 0) {
+          return "";
+        }
+
+        std::lock_guard<std::mutex> lock(mFiles->mutex);
+        auto & cached = mFiles->entries[name];
+        if (!cached.read
+            || cached.size != static_cast<long long>(info.st_size)
+            || cached.modified != static_cast<long long>(info.st_mtime)) {
+          std::ifstream file(name, std::ios::binary);
+          cached.contents.assign(std::istreambuf_iterator<char>(file),
+                                 std::istreambuf_iterator<char>());
+          cached.size = info.st_size;
+          cached.modified = info.st_mtime;
+          cached.read = true;
+        }
+        return cached.contents;
+      }
+
     private:
+      struct File {
+        bool read = false;
+        long long size = 0;
+        long long modified = 0;
+        std::string contents;
+      };
+
+      // Shared by copies, which read the same files
+      struct Files {
+        std::mutex mutex;
+        std::unordered_map<std::string, File> entries;
+      };
+
       const std::string mBuildString;
+      const std::shared_ptr<Files> mFiles;
     };
   }
 }
\ No newline at end of file
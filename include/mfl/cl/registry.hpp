@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+namespace mfl {
+  namespace cl {
+
+    // Name keyed map split into independently locked shards, so lookups of
+    // different names rarely touch the same lock and lookups of the same
+    // name only share it
+    template<typename T, std::size_t SHARDS = 16>
+    class Registry {
+    public:
+      struct Shard {
+        mutable std::shared_timed_mutex mutex;
+        std::unordered_map<std::string, T> entries;
+      };
+
+      Shard & shard(const std::string & name) {
+        return mShards[std::hash<std::string>()(name) % SHARDS];
+      }
+
+      const Shard & shard(const std::string & name) const {
+        return mShards[std::hash<std::string>()(name) % SHARDS];
+      }
+
+      bool contains(const std::string & name) const {
+        auto & shard = this->shard(name);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+        return shard.entries.find(name) != shard.entries.end();
+      }
+
+      bool find(const std::string & name, T & value) const {
+        auto & shard = this->shard(name);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+        auto entry = shard.entries.find(name);
+        if (entry == shard.entries.end()) {
+          return false;
+        }
+        value = entry->second;
+        return true;
+      }
+
+      bool insert(const std::string & name, T && value) {
+        auto & shard = this->shard(name);
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+        return shard.entries.emplace(name, std::move(value)).second;
+      }
+
+      bool erase(const std::string & name) {
+        auto & shard = this->shard(name);
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+        return shard.entries.erase(name) > 0;
+      }
+
+      // Visits every entry holding one shard lock at a time; stops early
+      // when the visitor returns true
+      template<typename Visitor>
+      bool any(Visitor && visitor) const {
+        for (auto & shard : mShards) {
+          std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+          for (auto & entry : shard.entries) {
+            if (visitor(entry.first, entry.second)) {
+              return true;
+            }
+          }
+        }
+        return false;
+      }
+
+      std::array<Shard, SHARDS> & shards() {
+        return mShards;
+      }
+
+    private:
+      std::array<Shard, SHARDS> mShards;
+    };
+  }
+}
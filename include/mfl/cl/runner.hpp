@@ -1,8 +1,15 @@
 ﻿#pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
+#include <thread>
 #include <unordered_map>
 
 #define __CL_ENABLE_EXCEPTIONS
@@ -12,20 +19,132 @@
 #include <mfl/string.hpp>
 #include <mfl/exception.hpp>
 
+#include "cache.hpp"
+#include "device.hpp"
+#include "future.hpp"
+#include "graph.hpp"
+#include "kernel.hpp"
+#include "pool.hpp"
+#include "profiler.hpp"
+#include "registry.hpp"
+#include "specialization.hpp"
+#include "staging.hpp"
+#include "stream.hpp"
+#include "trace.hpp"
+#include "tracker.hpp"
+#include "tuner.hpp"
+#include "view.hpp"
 #include "program.hpp"
 
 namespace mfl {
   namespace cl {
 
+    struct BuildLog {
+      std::string program;
+      bool cached;
+      // "cache", "binary", "il" or "source", or "deferred" until built
+      const char * format;
+      std::uint64_t createNanoseconds;
+      std::uint64_t buildNanoseconds;
+      std::vector<std::pair<std::string, std::string>> devices;
+    };
+
+    // Buffer written by a dispatched kernel through the argument, holding
+    // bytesPerItem bytes for each work item
+    struct DispatchOutput {
+      cl_uint argument;
+      std::string buffer;
+      std::size_t bytesPerItem;
+    };
+
+    struct DispatchStatistics {
+      std::vector<std::size_t> items;
+      std::vector<std::size_t> chunks;
+      // Last chunk of each device that ran any; the range is done once
+      // every one of them has completed
+      std::vector<::cl::Event> events;
+    };
+
+    struct ResidencyStatistics {
+      std::size_t budget;
+      std::size_t resident;
+      std::size_t spilled;
+      std::size_t evictions;
+      std::size_t restores;
+    };
+
+    struct BufferLocality {
+      std::string name;
+      // Index of the device last holding the contents, -1 when unknown
+      int device;
+      std::size_t migrations;
+      std::uint64_t bytes;
+    };
+
+    // Selects the Runner constructor that defers device discovery and
+    // context creation to first use, and program builds to the first kernel
+    // made from them
+    struct Deferred {};
+
     class Runner {
     public:
+      static const std::size_t ANY_DEVICE = SIZE_MAX;
 
+      // Uses the platform whose compatible devices score highest in total,
+      // and orders its devices best first
       Runner(cl_device_type type,
              bool verbose = false,
              const std::vector<const char *> & requirements
-             = std::vector<const char *>(0));
+             = std::vector<const char *>(0),
+             const DeviceScore & score = estimatedThroughput);
+
+      Runner(Deferred,
+             cl_device_type type,
+             bool verbose = false,
+             const std::vector<const char *> & requirements
+             = std::vector<const char *>(0),
+             const DeviceScore & score = estimatedThroughput);
+
+      ~Runner();
+
+      const std::vector<DeviceInfo> & devices() const {
+        discover();
+        return mDeviceInfo;
+      }
+
+      // Replaces each device by its sub-devices, each then scheduled as a
+      // device of its own, and recreates the context. Must come before any
+      // program or buffer is created. Kernels, specializations and tuned
+      // sizes made for the whole devices are dropped. Returns the new
+      // device count
+      std::size_t partition(const DevicePartition & partition);
+
+      // Uses the first format every device can take: the binary cache,
+      // offline device binaries, SPIR-V through cl_khr_il_program, then source.
+      // When deferred, only registers the program, which must stay alive
+      // until the first kernel made from it builds it, or it is released
+      BuildLog loadProgram(const Program & program, bool verbose = false);
+
+      // Builds every program concurrently and registers the ones that succeed
+      std::vector<BuildLog> loadPrograms(const std::vector<const Program *> & programs,
+                                         bool verbose = false);
+
+      // Discovers devices and builds every program registered so far on a
+      // background thread. Failed builds are printed to stderr when verbose,
+      // then retried and thrown on first use. Later calls do nothing
+      void prewarm();
+
+      // Nanoseconds from construction until the first kernel was made, or 0
+      std::uint64_t timeToFirstKernel() const {
+        return mFirstKernel;
+      }
+
+      // Creates the directory if missing, and throws when it cannot
+      void enableBinaryCache(const std::string & directory);
 
-      void loadProgram(const Program & program, bool verbose = false);
+      const BinaryCache * binaryCache() const {
+        return mBinaryCache.get();
+      }
 
       void releaseProgram(const std::string & name);
 
@@ -33,21 +152,207 @@ namespace mfl {
 
       void releaseQueues();
 
+      // Recreates the queues with CL_QUEUE_PROFILING_ENABLE; queues handed
+      // out earlier are not profiled
+      void enableProfiling();
+
+      std::vector<KernelStatistics> kernelStatistics() const {
+        return mProfiler ? mProfiler->statistics() : std::vector<KernelStatistics>(0);
+      }
+
       ::cl::Kernel makeKernel(const std::string & program,
                               const std::string & kernelName,
                               bool verbose = false);
 
+      // Kernel from program built with the definitions appended to its build
+      // string. Variants are built on first use and cached by their values
+      ::cl::Kernel specialize(const Program & program,
+                              const std::string & kernelName,
+                              const std::vector<Define> & defines);
+
+      template<typename ... D>
+      ::cl::Kernel specialize(const Program & program,
+                              const std::string & kernelName,
+                              const Define & define,
+                              const D & ... defines) {
+        return specialize(program, kernelName, std::vector<Define>{define, defines...});
+      }
+
+      // Bounds the number of built variants kept; defaults to 64
+      void setSpecializationLimit(std::size_t variants) {
+        mSpecializations.setLimit(variants);
+      }
+
+      const SpecializationCache & specializations() const {
+        return mSpecializations;
+      }
+
+      // Kernel instance owned by the calling thread, created on first use and
+      // reused until a program is released. Safe to setArg without locking
+      ::cl::Kernel & threadKernel(const std::string & program,
+                                  const std::string & kernelName);
+
+      void enableAutotuning(const std::string & path);
+
+      // Benchmarks multiples of the preferred work group size multiple that
+      // fit the work group and local memory limits and records the fastest.
+      // Returns 0 when the driver's own choice won. Later launches of the
+      // same kernel and global size through launch() reuse the result.
+      // Every candidate runs the kernel six times with the arguments
+      // setArguments binds, so it should bind scratch buffers: anything the
+      // kernel writes is overwritten, and updates in place compound
+      std::size_t tune(const std::string & program,
+                       const std::string & kernelName,
+                       std::size_t device,
+                       std::size_t global,
+                       const std::function<void(::cl::Kernel &)> & setArguments,
+                       std::size_t localBytesPerItem = 0,
+                       bool force = false);
+
+      ::cl::Event launch(const ::cl::CommandQueue & queue,
+                         const ::cl::Kernel & kernel,
+                         const ::cl::NDRange & global,
+                         const ::cl::NDRange & local = ::cl::NullRange,
+                         const ::cl::NDRange & offset = ::cl::NullRange,
+                         const std::vector<::cl::Event> * events = nullptr);
+
+      // Settles from the event callback once the command completes, failing
+      // with the command's error. The command's queue must be flushed for
+      // the callback to ever fire
+      Future<void> completion(const ::cl::Event & event) const;
+
+      Future<void> launchAsync(const ::cl::CommandQueue & queue,
+                               const ::cl::Kernel & kernel,
+                               const ::cl::NDRange & global,
+                               const ::cl::NDRange & local = ::cl::NullRange,
+                               const ::cl::NDRange & offset = ::cl::NullRange,
+                               const std::vector<::cl::Event> * events = nullptr);
+
+      template<typename T>
+      Future<std::vector<T>> readAsync(const ::cl::CommandQueue & queue,
+                                       const std::string & name,
+                                       const std::vector<::cl::Event> * events = nullptr) {
+        TraceScope trace("transfer", name.c_str());
+
+        auto buffer = getBuffer(name);
+        try {
+          auto data = std::make_shared<std::vector<T>>(buffer.getInfo<CL_MEM_SIZE>() / sizeof(T));
+          ::cl::Event event;
+          queue.enqueueReadBuffer(buffer,
+                                  CL_FALSE,
+                                  0,
+                                  data->size() * sizeof(T),
+                                  data->data(),
+                                  events,
+                                  &event);
+          queue.flush();
+          return completion(event).then([data](const Future<void> & done) {
+            done.get();
+            return std::move(*data);
+          });
+        } catch (::cl::Error & err) {
+          throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                      err.what(),
+                                      err.err(),
+                                      getErrorString(err.err()));
+        }
+      }
+
+      // Keeps data alive until the write completes
+      template<typename T>
+      Future<void> writeAsync(const ::cl::CommandQueue & queue,
+                              const std::string & name,
+                              std::vector<T> data,
+                              const std::vector<::cl::Event> * events = nullptr) {
+        TraceScope trace("transfer", name.c_str());
+
+        auto buffer = getBuffer(name);
+        try {
+          auto owned = std::make_shared<std::vector<T>>(std::move(data));
+          ::cl::Event event;
+          queue.enqueueWriteBuffer(buffer,
+                                   CL_FALSE,
+                                   0,
+                                   owned->size() * sizeof(T),
+                                   owned->data(),
+                                   events,
+                                   &event);
+          queue.flush();
+          return completion(event).then([owned](const Future<void> & done) {
+            done.get();
+          });
+        } catch (::cl::Error & err) {
+          throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                      err.what(),
+                                      err.err(),
+                                      getErrorString(err.err()));
+        }
+      }
+
+      // Launches once every earlier submit writing a buffer in reads, or
+      // touching a buffer in writes, has completed. Independent submits run
+      // concurrently: on an out of order queue where the device has one,
+      // spread over several in order queues otherwise. Runs on the first
+      // device unless told otherwise; ANY_DEVICE runs it where most of the
+      // bytes read already are. Buffers held by another device are migrated
+      // to it first, with their contents
+      ::cl::Event submit(const ::cl::Kernel & kernel,
+                         const std::vector<std::string> & reads,
+                         const std::vector<std::string> & writes,
+                         const ::cl::NDRange & global,
+                         const ::cl::NDRange & local = ::cl::NullRange,
+                         std::size_t device = 0);
+
+      // Submits still running against the buffer, for host access to wait on
+      std::vector<::cl::Event> pendingEvents(const std::string & name) const {
+        return mTracker.pending(name);
+      }
+
+      // Waits for every submit so far
+      void synchronize();
+
+      // Splits a 1D range across every device, sizing chunks from the measured
+      // throughput of each device and letting idle devices take what is left.
+      // Each chunk gets its outputs bound to sub-buffers covering only its
+      // items, so devices never write the same buffer; kernels index them
+      // from get_global_id(0) - get_global_offset(0). Returns once the last
+      // chunk is enqueued, leaving the statistics' events to wait on
+      DispatchStatistics dispatch(const ::cl::Kernel & kernel,
+                                  const std::vector<DispatchOutput> & outputs,
+                                  std::size_t global,
+                                  std::size_t local = 0,
+                                  std::size_t offset = 0,
+                                  const std::vector<::cl::Event> * events = nullptr);
+
+      // Processes input larger than a single allocation tile by tile,
+      // overlapping transfers with compute
+      void stream(const void * input,
+                  std::size_t size,
+                  const StreamKernel & kernel,
+                  const StreamMerge & merge,
+                  const StreamOptions & options = StreamOptions());
+
+      void streamFile(const std::string & path,
+                      const StreamKernel & kernel,
+                      const StreamMerge & merge,
+                      const StreamOptions & options = StreamOptions());
+
+      // Named buffers in the graph are resolved through getBuffer on the
+      // first replay and stay pinned, and so are never spilled, until the
+      // graph is refreshed or destroyed
+      CommandGraph recordGraph();
+
       template<typename ... T>
-      ::cl::make_kernel<T...> makeKernelFunctor(const std::string & program,
-                                                const std::string & kernelName) {
-        auto builtProgram = mPrograms.find(program);
-        if (builtProgram == mPrograms.end()) {
+      KernelFunctor<T...> makeKernelFunctor(const std::string & program,
+                                            const std::string & kernelName) {
+        ::cl::Program builtProgram;
+        if (!findProgram(program, builtProgram)) {
           throw mfl::Exception::build("No program named {} has been loaded yet",
                                       program);
         }
 
         try {
-          return ::cl::make_kernel<T...>(builtProgram->second, kernelName);
+          return KernelFunctor<T...>(builtProgram, kernelName, mProfiler);
         } catch (::cl::Error & err) {
           throw mfl::Exception::build("OpenCL error: {} ({} : {})",
                                       err.what(),
@@ -57,16 +362,73 @@ namespace mfl {
       }
 
       template<typename ... Args>
-      const ::cl::Buffer & createBuffer(const std::string & name,
-                                        const Args & ... args) {
-        if (mBuffers.find(name) != mBuffers.end()) {
+      ::cl::Buffer createBuffer(const std::string & name,
+                                const Args & ... args) {
+        TraceScope trace("buffer", name.c_str());
+        discover();
+
+        if (mBuffers.contains(name)) {
           throw mfl::Exception::build("Trying to create a buffer with an"
                                           "existing name");
         }
 
         try {
-          return (mBuffers.emplace(name, ::cl::Buffer(mContext, args...))
-              .first)->second;
+          ::cl::Buffer buffer;
+          try {
+            buffer = ::cl::Buffer(mContext, args...);
+          } catch (::cl::Error & err) {
+            if (err.err() != CL_MEM_OBJECT_ALLOCATION_FAILURE || !spillAll()) {
+              throw;
+            }
+            buffer = ::cl::Buffer(mContext, args...);
+          }
+          return registerBuffer(name, std::move(buffer), true);
+        } catch (::cl::Error & err) {
+          throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                      err.what(),
+                                      err.err(),
+                                      getErrorString(err.err()));
+        }
+      }
+
+      // Allocated through the device's queue and first written there, so
+      // CPU runtimes place its pages on the device's NUMA node
+      ::cl::Buffer createBufferOn(const std::string & name,
+                                  std::size_t device,
+                                  cl_mem_flags flags,
+                                  std::size_t size);
+
+      // Falls back to a plain buffer when the pool is not enabled
+      ::cl::Buffer createPooledBuffer(const std::string & name,
+                                      cl_mem_flags flags,
+                                      std::size_t size);
+
+      void enableBufferPool(std::size_t slabSize = 16 * 1024 * 1024);
+
+      const BufferPool * bufferPool() const {
+        return mBufferPool.get();
+      }
+
+      // Backed by host memory aligned for every device when all of them
+      // share memory with the host, by driver pinned memory otherwise. The
+      // host memory is freed once the runtime destroys the buffer
+      ::cl::Buffer createHostBuffer(const std::string & name,
+                                    cl_mem_flags flags,
+                                    std::size_t size);
+
+      template<typename T>
+      MappedView<T> mapBuffer(const ::cl::CommandQueue & queue,
+                              const std::string & name,
+                              cl_map_flags flags) const {
+        auto hold = holdBuffers({name});
+        auto buffer = getBuffer(name);
+        try {
+          return MappedView<T>(queue,
+                               buffer,
+                               flags,
+                               buffer.getInfo<CL_MEM_SIZE>() / sizeof(T),
+                               0,
+                               hold);
         } catch (::cl::Error & err) {
           throw mfl::Exception::build("OpenCL error: {} ({} : {})",
                                       err.what(),
@@ -75,25 +437,105 @@ namespace mfl {
         }
       }
 
-      const ::cl::Buffer & getBuffer(const std::string & name) const {
-        return mBuffers.at(name);
+      // Rings of pinned host buffers that upload and download copy through,
+      // one per device so each copies through memory pinned for it. Zero
+      // slotBytes sizes slots from bufferMemory()
+      void enableStaging(std::size_t slots = 4, std::size_t slotBytes = 0);
+
+      const StagingRing * staging(std::size_t device = 0) const {
+        return mStaging.empty() ? nullptr : mStaging.at(device).get();
+      }
+
+      // data may be reused as soon as this returns. Without staging the
+      // write is blocking
+      ::cl::Event upload(const ::cl::CommandQueue & queue,
+                         const std::string & name,
+                         const void * data,
+                         std::size_t size,
+                         std::size_t offset = 0,
+                         const std::vector<::cl::Event> * events = nullptr);
+
+      void download(const ::cl::CommandQueue & queue,
+                    const std::string & name,
+                    void * data,
+                    std::size_t size,
+                    std::size_t offset = 0,
+                    const std::vector<::cl::Event> * events = nullptr);
+
+      // Named buffers are spilled to host memory, least recently used first,
+      // when an allocation would exceed the budget, and restored by the next
+      // getBuffer. A restored buffer is a new cl_mem, so references from
+      // earlier getBuffer calls do not survive a spill. Pinned buffers are
+      // never spilled, nor are those used by a running submit, a mapped view
+      // or a recorded graph
+      void setMemoryBudget(std::size_t bytes);
+
+      // Kernels keep the cl_mem they were given, so a buffer bound to a
+      // kernel that may still be launched must stay pinned, or be fetched
+      // and bound again before each launch. Pins nest
+      void pinBuffer(const std::string & name) const;
+
+      void unpinBuffer(const std::string & name) const;
+
+      // Pins the buffers until the returned handle is released. A pooled
+      // buffer released while held keeps its block until the handle is
+      std::shared_ptr<void> holdBuffers(const std::vector<std::string> & names) const;
+
+      ResidencyStatistics residency() const;
+
+      // Placement is followed through createBufferOn, upload, submit and
+      // prefetch; other commands leave it as it was
+      std::vector<BufferLocality> locality() const;
+
+      // Device holding the most bytes of the named buffers, 0 when none
+      // has been placed
+      std::size_t preferredDevice(const std::vector<std::string> & names) const;
+
+      // Migrates the named buffers held elsewhere to the device, so a later
+      // launch there does not wait for the move
+      ::cl::Event prefetch(const std::vector<std::string> & names,
+                           std::size_t device,
+                           const std::vector<::cl::Event> * events = nullptr);
+
+      bool zeroCopy() const {
+        discover();
+        return mZeroCopy;
+      }
+
+      // Returned by value, as a spill or release may replace the entry once
+      // the shard lock is dropped
+      ::cl::Buffer getBuffer(const std::string & name) const {
+        {
+          auto & shard = mBuffers.shard(name);
+          std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+          auto & entry = shard.entries.at(name);
+          entry.lastUse = std::chrono::steady_clock::now().time_since_epoch().count();
+          if (entry.resident) {
+            return entry.buffer;
+          }
+        }
+        return restore(name);
       }
 
       void releaseBuffer(const std::string & name);
 
       size_t totalMemory() const {
+        discover();
         return mTotalMemory;
       }
 
       size_t bufferMemory() const {
+        discover();
         return mBufferMemory;
       }
 
       const ::cl::Context & context() const {
+        discover();
         return mContext;
       }
 
       operator const ::cl::Context &() const {
+        discover();
         return mContext;
       }
 
@@ -282,14 +724,203 @@ namespace mfl {
       }
 
     private:
-      ::cl::Context mContext;
-      std::vector<::cl::Device> mDevices;
-      std::unordered_map<std::string, ::cl::Program> mPrograms;
+      struct BufferEntry {
+        ::cl::Buffer buffer;
+        std::size_t size;
+        cl_mem_flags flags;
+        bool evictable;
+        std::atomic<bool> resident;
+        std::atomic<std::size_t> pins;
+        // Held by holdBuffers handles, which may outlive the entry
+        std::shared_ptr<std::atomic<std::size_t>> holds;
+        std::atomic<std::uint64_t> lastUse;
+        std::vector<char> spilled;
+        bool pooled;
+        BufferPool::Block block;
+        std::atomic<int> device;
+        std::atomic<std::size_t> migrations;
+        std::atomic<std::uint64_t> migratedBytes;
+      };
+
+      struct DeferredProgram {
+        const Program * program;
+        bool verbose;
+        // Held while building, so concurrent first uses build once
+        std::mutex mutex;
+      };
+
+      Runner(bool deferred,
+             cl_device_type type,
+             bool verbose,
+             const std::vector<const char *> & requirements,
+             const DeviceScore & score);
+
+      // Finds the platform, devices and context on first call
+      void discover() const;
+
+      bool hasProgram(const std::string & name) const;
+
+      BuildLog deferProgram(const Program & program, bool verbose);
+
+      void buildDeferred(DeferredProgram & deferred);
+
+      // Builds the program first if it was deferred
+      bool findProgram(const std::string & name, ::cl::Program & program);
+
+      // Owned by its thread; the Runner empties it when destroyed, so no
+      // thread keeps the kernels, and with them the context, alive
+      struct ThreadKernels {
+        std::atomic<bool> alive{true};
+        std::uint64_t epoch = 0;
+        std::unordered_map<std::string, ::cl::Kernel> kernels;
+      };
+
+      struct CompiledModule {
+        // Held while compiling, so programs sharing a module compile it once
+        std::mutex mutex;
+        ::cl::Program header;
+        ::cl::Program object;
+      };
+
+      ::cl::Program buildProgram(const Program & program, BuildLog & log);
+
+      // Registers the program and indexes its handle for tunedLocal
+      bool insertProgram(const std::string & name, ::cl::Program && program);
+
+      // headerNames is a copy, since clCompileProgram takes a non-const array
+      void compile(const ::cl::Program & program,
+                   const char * options,
+                   const std::vector<cl_program> & headers,
+                   std::vector<const char *> headerNames) const;
+
+      std::shared_ptr<CompiledModule> compileModule(const Module & module);
+
+      // Compiles the program against its modules' headers and replaces it
+      // with the program linked from its object and theirs
+      void linkModules(const Program & program,
+                       const std::vector<const Module *> & modules,
+                       ::cl::Program & clProgram);
+
+      static void CL_CALLBACK completed(cl_event event, cl_int status, void * data);
+
+      static void CL_CALLBACK released(cl_event event, cl_int status, void * data);
+
+      // Keeps hold alive until the command completes
+      void holdUntil(const ::cl::Event & event, const std::shared_ptr<void> & hold) const;
+
+      static void printBuildLog(const Program & program, const BuildLog & log);
+
+      std::vector<std::string> binaryCacheKeys(const Program & program,
+                                               const std::string & il) const;
+
+      std::vector<std::string> programBinaries(const ::cl::Program & program) const;
+
+      // Lock order: residency, then buffer shards, then queues. Only spills
+      // and restores take the residency lock, so creating and releasing
+      // buffers within the budget contend on their shard alone
+      ::cl::Buffer registerBuffer(const std::string & name,
+                                  ::cl::Buffer && buffer,
+                                  bool evictable,
+                                  const BufferPool::Block * block = nullptr);
+
+      // Spills until the resident bytes plus bytes fit the budget, or
+      // everything spillable for SIZE_MAX. Returns whether anything moved.
+      // Expects the residency lock to be held
+      bool spill(std::size_t bytes) const;
+
+      bool spillAll();
+
+      ::cl::Buffer restore(const std::string & name) const;
+
+      int deviceIndex(const ::cl::CommandQueue & queue) const;
+
+      // Ring of the queue's device, null without staging
+      StagingRing * stagingRing(const ::cl::CommandQueue & queue) const;
+
+      void place(const std::string & name, int device) const;
+
+      // Enqueues the moves of buffers held elsewhere, contents included, as
+      // a kernel may write only part of a buffer. Empty when nothing moved
+      std::vector<::cl::Event> migrate(const ::cl::CommandQueue & queue,
+                                       std::size_t device,
+                                       const std::vector<std::string> & names,
+                                       const std::vector<::cl::Event> * events);
+
+      const ::cl::CommandQueue & transferQueue() const;
+      ::cl::CommandQueue trackedQueue(std::size_t device);
+
+      Stream makeStream(const StreamOptions & options) const;
+
+      std::string tuningKey(const std::string & program,
+                            const std::string & kernelName,
+                            std::size_t device,
+                            std::size_t global) const;
+
+      ::cl::NDRange tunedLocal(const ::cl::CommandQueue & queue,
+                               const ::cl::Kernel & kernel,
+                               const ::cl::NDRange & global) const;
+
+      const std::uint64_t mId;
+      std::atomic<std::uint64_t> mProgramEpoch;
+
+      const bool mDeferred;
+      const cl_device_type mType;
+      const bool mVerbose;
+      const std::vector<std::string> mRequirements;
+      const DeviceScore mScore;
+      const std::chrono::steady_clock::time_point mCreated;
+      std::atomic<std::uint64_t> mFirstKernel;
+
+      // Mutable so const accessors can discover the devices when deferred
+      mutable std::mutex mDiscoveryMutex;
+      mutable std::atomic<bool> mDiscovered;
+      mutable ::cl::Platform mPlatform;
+      mutable ::cl::Context mContext;
+      mutable std::vector<::cl::Device> mDevices;
+      mutable std::vector<DeviceInfo> mDeviceInfo;
+      Registry<::cl::Program> mPrograms;
+      // The registry holds the indexed programs, so their handles are not
+      // reused while indexed
+      mutable std::mutex mProgramNamesMutex;
+      std::unordered_map<cl_program, std::string> mProgramNames;
+      std::mutex mModulesMutex;
+      std::unordered_map<std::string, std::shared_ptr<CompiledModule>> mModules;
+      mutable std::mutex mDeferredMutex;
+      std::unordered_map<std::string, std::shared_ptr<DeferredProgram>> mDeferredPrograms;
+      std::once_flag mPrewarmOnce;
+      std::thread mPrewarm;
+      std::mutex mThreadKernelsMutex;
+      std::vector<std::weak_ptr<ThreadKernels>> mThreadKernels;
+      SpecializationCache mSpecializations;
+      mutable std::mutex mCommandsMutex;
       std::vector<::cl::CommandQueue> mCommands;
-      std::unordered_map<std::string, ::cl::Buffer> mBuffers;
-
-      size_t mTotalMemory;
-      size_t mBufferMemory;
+      std::vector<std::vector<::cl::CommandQueue>> mTrackedQueues;
+      std::atomic<std::size_t> mTrackedNext;
+      DependencyTracker mTracker;
+      cl_command_queue_properties mQueueProperties = 0;
+
+      // Mutable so const lookups can restore spilled buffers
+      mutable Registry<BufferEntry> mBuffers;
+      mutable std::mutex mResidencyMutex;
+      mutable ::cl::CommandQueue mTransferQueue;
+      mutable std::atomic<std::size_t> mBudget{0};
+      mutable std::atomic<std::size_t> mResident{0};
+      mutable std::atomic<std::size_t> mSpilled{0};
+      mutable std::atomic<std::size_t> mEvictions{0};
+      mutable std::atomic<std::size_t> mRestores{0};
+
+      std::unique_ptr<BinaryCache> mBinaryCache;
+      std::unique_ptr<TuningTable> mTuningTable;
+      std::shared_ptr<Profiler> mProfiler;
+      std::unique_ptr<BufferPool> mBufferPool;
+      std::vector<std::unique_ptr<StagingRing>> mStaging;
+
+      std::mutex mThroughputMutex;
+      std::unordered_map<std::string, std::vector<double>> mThroughput;
+
+      mutable size_t mTotalMemory;
+      mutable size_t mBufferMemory;
+      mutable bool mZeroCopy;
     };
   }
 }
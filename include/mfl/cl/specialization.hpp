@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <mfl/exception.hpp>
+
+#include "program.hpp"
+
+namespace mfl {
+  namespace cl {
+
+    // A -D definition rendered from a typed value, so Define("TILE", 16u)
+    // and Define("SCALE", 0.5f) reach the kernel with their OpenCL C type.
+    // Build options split on whitespace, so names and string values holding
+    // any are rejected
+    struct Define {
+      template<typename T>
+      Define(const std::string & name, const T & value) :
+          name(token(name)),
+          value(token(render(value))) {}
+
+      std::string name;
+      std::string value;
+
+    private:
+      static std::string token(const std::string & text) {
+        if (text.empty()
+            || std::any_of(text.begin(), text.end(), [](char c) {
+                 return std::isspace(static_cast<unsigned char>(c)) != 0;
+               })) {
+          throw mfl::Exception::build("Cannot define '{}' as a build option", text);
+        }
+        return text;
+      }
+
+      static std::string render(bool value) {
+        return value ? "1" : "0";
+      }
+
+      template<typename T>
+      static typename std::enable_if<std::is_integral<T>::value, std::string>::type
+      render(T value) {
+        return std::to_string(value)
+            + (std::is_unsigned<T>::value ? "u" : "")
+            + (sizeof(T) == 8 ? "L" : "");
+      }
+
+      template<typename T>
+      static typename std::enable_if<std::is_floating_point<T>::value, std::string>::type
+      render(T value) {
+        // From the OpenCL C math header, which every kernel has
+        if (std::isnan(value)) {
+          return "NAN";
+        }
+        if (std::isinf(value)) {
+          return value < 0 ? "(-INFINITY)" : "INFINITY";
+        }
+
+        std::ostringstream stream;
+        stream.precision(std::numeric_limits<T>::max_digits10);
+        stream << std::showpoint << value;
+        return stream.str() + (std::is_same<T, float>::value ? "f" : "");
+      }
+
+      static std::string render(const std::string & value) {
+        return value;
+      }
+
+      static std::string render(const char * value) {
+        return value;
+      }
+    };
+
+    // The base program with definitions appended to its build string
+    class SpecializedProgram : public Program {
+    public:
+      SpecializedProgram(const Program & base, const std::vector<Define> & defines);
+
+      const char * path() const override {
+        return mBase.path();
+      }
+
+      const std::string getSource() const override {
+        return mBase.getSource();
+      }
+
+      std::vector<const Module *> modules() const override {
+        return mBase.modules();
+      }
+
+      // Offline builds of the base lack the definitions, so variants always
+      // build from source
+      const std::string getIL() const override {
+        return "";
+      }
+
+      const std::string getBinary(const std::string &) const override {
+        return "";
+      }
+
+      const char * name() const override {
+        return mName.c_str();
+      }
+
+    private:
+      static std::string buildString(const Program & base, const std::vector<Define> & defines);
+
+      const Program & mBase;
+      const std::string mName;
+    };
+
+    // Built variants keyed by base program and definition values, the least
+    // recently used released beyond the limit. Kernels already made from an
+    // evicted variant keep it alive
+    class SpecializationCache {
+    public:
+      typedef std::function<::cl::Program(const Program & variant)> Build;
+
+      explicit SpecializationCache(std::size_t limit);
+
+      // Builds outside the lock, so variants build concurrently; two threads
+      // asking for the same new variant may both build it
+      ::cl::Program get(const Program & base,
+                        const std::vector<Define> & defines,
+                        const Build & build);
+
+      void setLimit(std::size_t limit);
+
+      void clear();
+
+      std::size_t size() const;
+
+      std::size_t hits() const {
+        return mHits;
+      }
+
+      std::size_t misses() const {
+        return mMisses;
+      }
+
+      std::size_t evictions() const {
+        return mEvictions;
+      }
+
+    private:
+      struct Entry {
+        ::cl::Program program;
+        std::list<std::string>::iterator use;
+      };
+
+      void evict();
+
+      mutable std::mutex mMutex;
+      std::size_t mLimit;
+      std::list<std::string> mUses;
+      std::unordered_map<std::string, Entry> mEntries;
+      std::atomic<std::size_t> mHits;
+      std::atomic<std::size_t> mMisses;
+      std::atomic<std::size_t> mEvictions;
+    };
+  }
+}
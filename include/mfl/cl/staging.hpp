@@ -0,0 +1,71 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    // Pinned host buffers, mapped once for their whole life, that transfers
+    // are copied through so the driver can DMA straight from them. Slots
+    // are reused in order, waiting on the oldest when all are in flight
+    class StagingRing {
+    public:
+      StagingRing(const ::cl::Context & context,
+                  const ::cl::Device & device,
+                  std::size_t slotBytes,
+                  std::size_t slots);
+
+      StagingRing(const StagingRing &) = delete;
+
+      StagingRing & operator=(const StagingRing &) = delete;
+
+      ~StagingRing();
+
+      // Returns once data has been copied out, so it can be reused at once;
+      // the event completes when every chunk has been written to the device
+      // buffer
+      ::cl::Event upload(const ::cl::CommandQueue & queue,
+                         const ::cl::Buffer & buffer,
+                         const void * data,
+                         std::size_t size,
+                         std::size_t offset = 0,
+                         const std::vector<::cl::Event> * events = nullptr);
+
+      // Keeps every slot reading while earlier chunks are copied out
+      void download(const ::cl::CommandQueue & queue,
+                    const ::cl::Buffer & buffer,
+                    void * data,
+                    std::size_t size,
+                    std::size_t offset = 0,
+                    const std::vector<::cl::Event> * events = nullptr);
+
+      std::size_t slotBytes() const {
+        return mSlotBytes;
+      }
+
+      std::size_t slots() const {
+        return mSlots.size();
+      }
+
+    private:
+      struct Slot {
+        ::cl::Buffer buffer;
+        char * data;
+        ::cl::Event event;
+      };
+
+      Slot & acquire();
+
+      const std::size_t mSlotBytes;
+
+      std::mutex mMutex;
+      ::cl::CommandQueue mQueue;
+      std::vector<Slot> mSlots;
+      std::size_t mNext;
+    };
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    struct StreamOptions {
+      // Zero picks a tile size from the device memory limits
+      std::size_t tileBytes = 0;
+      // Output bytes of a full tile; zero means the same as tileBytes
+      std::size_t outputBytes = 0;
+      // Tiles in flight: two for double buffering, three for triple
+      std::size_t depth = 3;
+      std::size_t device = 0;
+    };
+
+    // Enqueues the work for one tile on queue, waiting on wait and
+    // signalling done once output is written
+    typedef std::function<void(const ::cl::CommandQueue & queue,
+                               const ::cl::Buffer & input,
+                               const ::cl::Buffer & output,
+                               std::size_t tile,
+                               std::size_t bytes,
+                               const std::vector<::cl::Event> & wait,
+                               ::cl::Event & done)> StreamKernel;
+
+    // Called in tile order on the calling thread
+    typedef std::function<void(std::size_t tile,
+                               const char * output,
+                               std::size_t bytes)> StreamMerge;
+
+    // Fills staging or returns a pointer that stays valid until the stream ends
+    typedef std::function<const char *(std::size_t offset,
+                                       std::size_t bytes,
+                                       std::vector<char> & staging)> StreamSource;
+
+    // Overlaps upload, compute and download of consecutive tiles on three
+    // queues of one device, with depth sets of device buffers in rotation
+    class Stream {
+    public:
+      Stream(const ::cl::Context & context,
+             const ::cl::Device & device,
+             cl_command_queue_properties properties,
+             std::size_t tileBytes,
+             std::size_t outputBytes,
+             std::size_t depth);
+
+      // Rethrows whatever source, kernel or merge throws, once every command
+      // already enqueued has finished
+      void run(std::size_t size,
+               const StreamSource & source,
+               const StreamKernel & kernel,
+               const StreamMerge & merge);
+
+    private:
+      struct Slot {
+        ::cl::Buffer input;
+        ::cl::Buffer output;
+        std::vector<char> staging;
+        std::vector<char> result;
+        ::cl::Event download;
+        std::size_t tile;
+        std::size_t bytes;
+        bool busy;
+      };
+
+      void drain(Slot & slot, const StreamMerge & merge);
+
+      // Waits out every queue after a failure, so no read into a slot or
+      // write from the source's memory outlives the memory
+      void abandon();
+
+      const std::size_t mTileBytes;
+      const std::size_t mOutputBytes;
+
+      ::cl::CommandQueue mUpload;
+      ::cl::CommandQueue mCompute;
+      ::cl::CommandQueue mDownload;
+      std::vector<Slot> mSlots;
+    };
+  }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    // Process-wide timeline of host calls and device commands, on by
+    // default. Each thread appends spans to its own ring without locking,
+    // overwriting its oldest once the ring is full. A thread starting after
+    // another exited takes over its ring, and its track
+    class Trace {
+    public:
+      static const std::size_t RING_SPANS = 2048;
+
+      static bool enabled();
+
+      static void setEnabled(bool enabled);
+
+      // Nanoseconds on the steady clock
+      static std::uint64_t now();
+
+      // Longer names are truncated
+      static void record(const char * category,
+                         const char * name,
+                         std::uint64_t start,
+                         std::uint64_t end);
+
+      // Records the command on the queue's track once it completes. Needs a
+      // queue created with CL_QUEUE_PROFILING_ENABLE. Device timestamps are
+      // moved onto the host clock by the smallest gap yet seen between a
+      // command ending and its completion reaching the host
+      static void recordDevice(const ::cl::CommandQueue & queue,
+                               const ::cl::Event & event,
+                               const std::string & name);
+
+      // Chrome trace event JSON, which chrome://tracing and Perfetto load,
+      // with a track per host thread and per command queue
+      static void write(std::ostream & out);
+
+      static void dump(const std::string & path);
+
+      static void clear();
+    };
+
+    // Records the enclosing scope as a span on the calling thread. Both
+    // strings must outlive the scope
+    class TraceScope {
+    public:
+      TraceScope(const char * category, const char * name) :
+          mCategory(category),
+          mName(name),
+          mStart(Trace::enabled() ? Trace::now() : 0) {}
+
+      TraceScope(const TraceScope &) = delete;
+
+      TraceScope & operator=(const TraceScope &) = delete;
+
+      ~TraceScope() {
+        if (mStart) {
+          Trace::record(mCategory, mName, mStart, Trace::now());
+        }
+      }
+
+    private:
+      const char * const mCategory;
+      const char * const mName;
+      const std::uint64_t mStart;
+    };
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    // Receives the events a command has to wait on and returns its own
+    typedef std::function<::cl::Event(const std::vector<::cl::Event> & wait)> TrackedCommand;
+
+    // Orders commands by the named buffers they read and write: reads wait
+    // on the last write, writes wait on the reads since then or, failing
+    // that, on the last write. Commands are enqueued outside the lock, so
+    // only those depending on each other wait for one another's enqueue. A
+    // failed command is reported as a ::cl::Error to every command depending
+    // on it until its buffers are forgotten or the tracker cleared
+    class DependencyTracker {
+    public:
+      ::cl::Event track(const std::vector<std::string> & reads,
+                        const std::vector<std::string> & writes,
+                        const TrackedCommand & command);
+
+      // Events still pending on the buffer
+      std::vector<::cl::Event> pending(const std::string & name) const;
+
+      // Returns the events of the commands last ordered on the buffer,
+      // finished or not, failed ones included
+      std::vector<::cl::Event> forget(const std::string & name);
+
+      void clear();
+
+    private:
+      // A place in the order, filled in once the command is enqueued
+      struct Slot {
+        bool enqueued = false;
+        std::vector<::cl::Event> events;
+      };
+
+      struct Hazards {
+        std::shared_ptr<Slot> write;
+        std::vector<std::shared_ptr<Slot>> reads;
+      };
+
+      void publish(Slot & slot, std::vector<::cl::Event> events);
+
+      mutable std::mutex mMutex;
+      mutable std::condition_variable mEnqueued;
+      std::unordered_map<std::string, Hazards> mHazards;
+    };
+  }
+}
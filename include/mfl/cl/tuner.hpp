@@ -0,0 +1,44 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace mfl {
+  namespace cl {
+
+    // On-disk table of the best local size per (program, kernel, device,
+    // global size). Entries recorded under another driver version are
+    // treated as missing so they get re-tuned
+    class TuningTable {
+    public:
+      TuningTable(const std::string & path);
+
+      bool lookup(const std::string & key,
+                  const std::string & driver,
+                  std::size_t & local) const;
+
+      // Rewrites the file, throwing when it cannot
+      void store(const std::string & key,
+                 const std::string & driver,
+                 std::size_t local);
+
+      const std::string & path() const {
+        return mPath;
+      }
+
+    private:
+      struct Entry {
+        std::string driver;
+        std::size_t local;
+      };
+
+      void save() const;
+
+      const std::string mPath;
+
+      mutable std::mutex mMutex;
+      std::unordered_map<std::string, Entry> mEntries;
+    };
+  }
+}
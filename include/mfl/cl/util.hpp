@@ -1,8 +1,24 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <thread>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
 
+#include "device.hpp"
+
 #include <mfl/exception.hpp>
 #include <mfl/string.hpp>
 #include <mfl/out.hpp>
@@ -12,7 +28,10 @@ namespace mfl {
     namespace util {
       /////////////////////////////////////
       // OpenCL Helper
-      inline std::vector<::cl::Device> getGPUDevices() {
+      // Every GPU of the platform with the highest estimated throughput,
+      // best first
+      inline std::vector<::cl::Device> getGPUDevices(const DeviceScore & score
+                                                     = estimatedThroughput) {
         std::vector<::cl::Device> devices;
 
         std::vector<::cl::Platform> platforms;
@@ -23,20 +42,19 @@ namespace mfl {
           return devices;
         }
 
-        std::vector<::cl::Device> platformDevices;
-        for (auto &platform : platforms) {
-          try {
-            platform.getDevices(CL_DEVICE_TYPE_GPU, &platformDevices);
-            for (auto &device : platformDevices) {
-              devices.push_back(device);
-              break;
-            }
-            if (!devices.empty()) {
-              break;
-            }
-          } catch (...) {
-            devices.clear();
-          }
+        std::vector<DeviceInfo> selected;
+        try {
+          selectDevices(platforms,
+                        CL_DEVICE_TYPE_GPU,
+                        std::vector<const char *>(0),
+                        score,
+                        selected);
+        } catch (...) {
+          selected.clear();
+        }
+
+        for (auto & info : selected) {
+          devices.push_back(info.device);
         }
 
         if (devices.empty()) {
@@ -89,6 +107,76 @@ namespace mfl {
         }
       }
 
+      /////////////////////////////////////
+      // File Helper
+      inline std::uint64_t hash(const std::string & data,
+                                std::uint64_t seed = 14695981039346656037ull) {
+        std::uint64_t hash = seed;
+        for (unsigned char byte : data) {
+          hash ^= byte;
+          hash *= 1099511628211ull;
+        }
+        return hash;
+      }
+
+      inline bool readFile(const std::string & path, std::string & data) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+          return false;
+        }
+
+        data.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+        return !file.bad();
+      }
+
+      inline bool writeFileAtomically(const std::string & path,
+                                      const std::string & data) {
+        auto temporary = path + ".tmp"
+            + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()))
+            + "."
+            + std::to_string(std::chrono::steady_clock::now()
+                                 .time_since_epoch().count());
+
+        {
+          std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+          if (!file.write(data.data(), data.size()) || !file.flush()) {
+            file.close();
+            std::remove(temporary.c_str());
+            return false;
+          }
+        }
+
+#ifdef _WIN32
+        std::remove(path.c_str());
+#endif
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+          std::remove(temporary.c_str());
+          return false;
+        }
+        return true;
+      }
+
+      // Creates the directory and any missing parent. True if it exists after
+      inline bool makeDirectories(const std::string & path) {
+        for (auto end = path.find_first_of("/\\", 1);
+             ;
+             end = path.find_first_of("/\\", end + 1)) {
+          auto part = path.substr(0, end);
+#ifdef _WIN32
+          _mkdir(part.c_str());
+#else
+          mkdir(part.c_str(), 0755);
+#endif
+          if (end == std::string::npos) {
+            break;
+          }
+        }
+
+        struct stat info;
+        return stat(path.c_str(), &info) == 0 && (info.st_mode & S_IFDIR);
+      }
+
       inline void printLongDeviceInfo(const ::cl::Device &device) {
         mfl::out::println(
             "=========================|\n"
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <memory>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    // Maps a buffer for host access for as long as the view lives. On
+    // devices sharing host memory with CL_MEM_USE_HOST_PTR buffers this is
+    // a pointer hand-off; elsewhere the driver copies on map and unmap.
+    // hold is released once the unmap completes
+    template<typename T>
+    class MappedView {
+    public:
+      MappedView(const ::cl::CommandQueue & queue,
+                 const ::cl::Buffer & buffer,
+                 cl_map_flags flags,
+                 std::size_t count,
+                 std::size_t offset = 0,
+                 std::shared_ptr<void> hold = nullptr) :
+          mQueue(queue),
+          mBuffer(buffer),
+          mHold(std::move(hold)),
+          mData(static_cast<T *>(queue.enqueueMapBuffer(buffer,
+                                                        CL_TRUE,
+                                                        flags,
+                                                        offset * sizeof(T),
+                                                        count * sizeof(T)))),
+          mSize(count) {}
+
+      MappedView(const MappedView &) = delete;
+
+      MappedView & operator=(const MappedView &) = delete;
+
+      MappedView(MappedView && other) :
+          mQueue(other.mQueue),
+          mBuffer(other.mBuffer),
+          mHold(std::move(other.mHold)),
+          mData(other.mData),
+          mSize(other.mSize) {
+        other.mData = nullptr;
+        other.mSize = 0;
+      }
+
+      ~MappedView() {
+        if (mData) {
+          try {
+            ::cl::Event event;
+            mQueue.enqueueUnmapMemObject(mBuffer, mData, nullptr, &event);
+            if (mHold) {
+              // The unmap may still write the buffer back, so the hold
+              // lasts until it completes
+              try {
+                std::unique_ptr<std::shared_ptr<void>> held(new std::shared_ptr<void>(mHold));
+                event.setCallback(CL_COMPLETE, &MappedView::unmapped, held.get());
+                held.release();
+                mQueue.flush();
+              } catch (::cl::Error &) {
+                event.wait();
+              }
+            }
+          } catch (...) {
+          }
+        }
+      }
+
+      T * data() const {
+        return mData;
+      }
+
+      std::size_t size() const {
+        return mSize;
+      }
+
+      T * begin() const {
+        return mData;
+      }
+
+      T * end() const {
+        return mData + mSize;
+      }
+
+      T & operator[](std::size_t index) const {
+        return mData[index];
+      }
+
+    private:
+      static void CL_CALLBACK unmapped(cl_event, cl_int, void * data) {
+        delete static_cast<std::shared_ptr<void> *>(data);
+      }
+
+      ::cl::CommandQueue mQueue;
+      ::cl::Buffer mBuffer;
+      std::shared_ptr<void> mHold;
+      T * mData;
+      std::size_t mSize;
+    };
+  }
+}
@@ -0,0 +1,152 @@
+#include "include/mfl/cl/pool.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#include <mfl/exception.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    namespace {
+      const std::size_t MINIMUM_BLOCK = 256;
+      const std::size_t DEDICATED = SIZE_MAX;
+
+      std::size_t roundUpToPowerOfTwo(std::size_t value) {
+        std::size_t power = 1;
+        while (power < value) {
+          power <<= 1;
+        }
+        return power;
+      }
+
+      std::size_t roundDownToPowerOfTwo(std::size_t value) {
+        std::size_t power = 1;
+        while (power <= value / 2) {
+          power <<= 1;
+        }
+        return power;
+      }
+    }
+
+    BufferPool::BufferPool(const ::cl::Context & context,
+                           std::size_t alignment,
+                           std::size_t slabSize) :
+        mContext(context),
+        mMinimumBlock(roundUpToPowerOfTwo(std::max(alignment, MINIMUM_BLOCK))),
+        mSlabSize(std::max(roundDownToPowerOfTwo(slabSize), mMinimumBlock)),
+        mStatistics() {}
+
+    ::cl::Buffer BufferPool::allocate(cl_mem_flags flags,
+                                      std::size_t size,
+                                      Block & block) {
+      if (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR)) {
+        throw mfl::Exception::build("Pooled buffers cannot use host pointer flags");
+      }
+
+      if (size == 0) {
+        throw mfl::Exception::build("Trying to allocate an empty pooled buffer");
+      }
+
+      if (size > mSlabSize) {
+        ::cl::Buffer buffer(mContext, flags, size);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        block = Block{DEDICATED, 0, 0, size};
+        mStatistics.reserved += size;
+        mStatistics.allocated += size;
+        mStatistics.requested += size;
+        mStatistics.blocks++;
+        mStatistics.highWaterMark = std::max(mStatistics.highWaterMark,
+                                             mStatistics.allocated);
+        return buffer;
+      }
+
+      std::size_t sizeClass = 0;
+      while (blockSize(sizeClass) < size) {
+        sizeClass++;
+      }
+
+      std::lock_guard<std::mutex> lock(mMutex);
+      reclaim();
+      if (mClasses.size() <= sizeClass) {
+        mClasses.resize(sizeClass + 1);
+      }
+
+      auto & bucket = mClasses[sizeClass];
+      if (bucket.free.empty()) {
+        bucket.slabs.emplace_back(mContext, CL_MEM_READ_WRITE, mSlabSize);
+        mStatistics.reserved += mSlabSize;
+        mStatistics.slabs++;
+
+        auto slab = bucket.slabs.size() - 1;
+        for (std::size_t offset = mSlabSize; offset > 0;) {
+          offset -= blockSize(sizeClass);
+          bucket.free.emplace_back(slab, offset);
+        }
+      }
+
+      auto location = bucket.free.back();
+
+      cl_buffer_region region;
+      region.origin = location.second;
+      region.size = size;
+      auto buffer = bucket.slabs[location.first]
+          .createSubBuffer(flags & (CL_MEM_READ_WRITE | CL_MEM_READ_ONLY | CL_MEM_WRITE_ONLY),
+                           CL_BUFFER_CREATE_TYPE_REGION,
+                           &region);
+
+      bucket.free.pop_back();
+      block = Block{sizeClass, location.first, location.second, size};
+      mStatistics.allocated += blockSize(sizeClass);
+      mStatistics.requested += size;
+      mStatistics.blocks++;
+      mStatistics.highWaterMark = std::max(mStatistics.highWaterMark,
+                                           mStatistics.allocated);
+      return buffer;
+    }
+
+    void BufferPool::release(const Block & block, const std::function<bool()> & reusable) {
+      std::lock_guard<std::mutex> lock(mMutex);
+
+      // Dedicated blocks are buffers of their own, kept alive by the runtime
+      // for as long as commands use them
+      if (reusable && block.sizeClass != DEDICATED) {
+        mRetired.push_back({block, reusable});
+        return;
+      }
+      recycle(block);
+    }
+
+    void BufferPool::reclaim() {
+      auto waiting = std::partition(mRetired.begin(),
+                                    mRetired.end(),
+                                    [](const Retired & retired) {
+                                      return !retired.reusable();
+                                    });
+      for (auto retired = waiting; retired != mRetired.end(); ++retired) {
+        recycle(retired->block);
+      }
+      mRetired.erase(waiting, mRetired.end());
+    }
+
+    void BufferPool::recycle(const Block & block) {
+      mStatistics.requested -= block.size;
+      mStatistics.blocks--;
+
+      if (block.sizeClass == DEDICATED) {
+        mStatistics.reserved -= block.size;
+        mStatistics.allocated -= block.size;
+        return;
+      }
+
+      mStatistics.allocated -= blockSize(block.sizeClass);
+      mClasses[block.sizeClass].free.emplace_back(block.slab, block.offset);
+    }
+
+    PoolStatistics BufferPool::statistics() const {
+      std::lock_guard<std::mutex> lock(mMutex);
+      return mStatistics;
+    }
+  }
+}
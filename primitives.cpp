@@ -0,0 +1,603 @@
+#include "include/mfl/cl/primitives.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include <mfl/exception.hpp>
+
+#include "include/mfl/cl/runner.hpp"
+
+namespace mfl {
+  namespace cl {
+
+    namespace {
+      // Built with T as the element type and WG as the work group size,
+      // a power of two
+      const char * const SOURCE = R"CLC(
+#if defined(cl_khr_fp64)
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#define TILE (2 * WG)
+#define DIGITS 16
+
+__kernel void reduce(__global const T * input, __global T * output, const uint count) {
+  __local T scratch[WG];
+  const uint lid = get_local_id(0);
+
+  T sum = 0;
+  for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+    sum += input[i];
+  }
+  scratch[lid] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (uint offset = WG / 2; offset > 0; offset >>= 1) {
+    if (lid < offset) {
+      scratch[lid] += scratch[lid + offset];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid == 0) {
+    output[get_group_id(0)] = scratch[0];
+  }
+}
+
+// Work-efficient scan of one tile of 2 * WG elements, leaving the tile total
+// in sums. Input and output may alias
+__kernel void scan_blocks(__global const T * input,
+                          __global T * output,
+                          __global T * sums,
+                          const uint count,
+                          const uint inclusive) {
+  __local T tile[TILE];
+  const uint lid = get_local_id(0);
+  const uint a = get_group_id(0) * TILE + lid;
+  const uint b = a + WG;
+
+  const T valueA = a < count ? input[a] : 0;
+  const T valueB = b < count ? input[b] : 0;
+  tile[lid] = valueA;
+  tile[lid + WG] = valueB;
+
+  uint offset = 1;
+  for (uint d = WG; d > 0; d >>= 1) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < d) {
+      tile[offset * (2 * lid + 2) - 1] += tile[offset * (2 * lid + 1) - 1];
+    }
+    offset <<= 1;
+  }
+
+  if (lid == 0) {
+    sums[get_group_id(0)] = tile[TILE - 1];
+    tile[TILE - 1] = 0;
+  }
+
+  for (uint d = 1; d < TILE; d <<= 1) {
+    offset >>= 1;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < d) {
+      const uint left = offset * (2 * lid + 1) - 1;
+      const uint right = offset * (2 * lid + 2) - 1;
+      const T value = tile[left];
+      tile[left] = tile[right];
+      tile[right] += value;
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (a < count) {
+    output[a] = inclusive ? tile[lid] + valueA : tile[lid];
+  }
+  if (b < count) {
+    output[b] = inclusive ? tile[lid + WG] + valueB : tile[lid + WG];
+  }
+}
+
+__kernel void add_offsets(__global T * output, __global const T * sums, const uint count) {
+  const uint i = get_global_id(0);
+  if (i < count) {
+    output[i] += sums[i / TILE];
+  }
+}
+
+__kernel void normalize_flags(__global const uint * flags,
+                              __global uint * normalized,
+                              const uint count) {
+  const uint i = get_global_id(0);
+  if (i < count) {
+    normalized[i] = flags[i] != 0;
+  }
+}
+
+__kernel void scatter(__global const T * input,
+                      __global const uint * flags,
+                      __global const uint * positions,
+                      __global T * output,
+                      const uint count) {
+  const uint i = get_global_id(0);
+  if (i < count && flags[i]) {
+    output[positions[i]] = input[i];
+  }
+}
+
+// Digit counts laid out digit-major, so that their exclusive scan gives each
+// group's first slot for each digit
+__kernel void radix_count(__global const uint * keys,
+                          __global uint * counts,
+                          const uint count,
+                          const uint shift) {
+  __local uint histogram[DIGITS];
+  const uint lid = get_local_id(0);
+  const uint i = get_global_id(0);
+
+  for (uint digit = lid; digit < DIGITS; digit += WG) {
+    histogram[digit] = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (i < count) {
+    atomic_inc(&histogram[(keys[i] >> shift) & (DIGITS - 1)]);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (uint digit = lid; digit < DIGITS; digit += WG) {
+    counts[digit * get_num_groups(0) + get_group_id(0)] = histogram[digit];
+  }
+}
+
+// Sorts the group's keys by digit with four stable one-bit splits, then
+// writes each key at its group's offset for the digit plus its rank among
+// the group's keys with that digit. Padding keys sort last and are dropped
+__kernel void radix_scatter(__global const uint * keys,
+                            __global uint * sorted,
+                            __global const uint * offsets,
+                            const uint count,
+                            const uint shift) {
+  __local uint tile[WG];
+  __local uint ones[WG];
+  __local uint start[DIGITS];
+  const uint lid = get_local_id(0);
+  const uint group = get_group_id(0);
+  const uint i = get_global_id(0);
+  const uint valid = min((uint) WG, count - group * WG);
+
+  uint key = i < count ? keys[i] : 0xFFFFFFFFu;
+
+  for (uint bit = 0; bit < 4; ++bit) {
+    const uint set = (key >> (shift + bit)) & 1;
+    ones[lid] = set;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint offset = 1; offset < WG; offset <<= 1) {
+      const uint value = lid >= offset ? ones[lid - offset] : 0;
+      barrier(CLK_LOCAL_MEM_FENCE);
+      ones[lid] += value;
+      barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    const uint before = ones[lid] - set;
+    const uint position = set ? WG - ones[WG - 1] + before : lid - before;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    tile[position] = key;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    key = tile[lid];
+  }
+
+  const uint digit = (key >> shift) & (DIGITS - 1);
+  if (lid == 0 || ((tile[lid - 1] >> shift) & (DIGITS - 1)) != digit) {
+    start[digit] = lid;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (lid < valid) {
+    sorted[offsets[digit * get_num_groups(0) + group] + lid - start[digit]] = key;
+  }
+}
+
+__kernel void histogram(__global const uint * input,
+                        __global uint * bins,
+                        __local uint * local_bins,
+                        const uint count,
+                        const uint bin_count) {
+  const uint lid = get_local_id(0);
+
+  for (uint bin = lid; bin < bin_count; bin += WG) {
+    local_bins[bin] = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+    const uint value = input[i];
+    if (value < bin_count) {
+      atomic_inc(&local_bins[value]);
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (uint bin = lid; bin < bin_count; bin += WG) {
+    if (local_bins[bin]) {
+      atomic_add(&bins[bin], local_bins[bin]);
+    }
+  }
+}
+
+// For bin counts beyond local memory
+__kernel void histogram_global(__global const uint * input,
+                               __global uint * bins,
+                               const uint count,
+                               const uint bin_count) {
+  for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+    const uint value = input[i];
+    if (value < bin_count) {
+      atomic_inc(&bins[value]);
+    }
+  }
+}
+)CLC";
+
+      const std::size_t MAX_WORK_GROUP_SIZE = 256;
+      const std::size_t DIGITS = 16;
+      // Widest element type, so that one work group size fits every variant
+      const std::size_t MAX_ELEMENT_SIZE = 8;
+      // Reduction and histogram groups per compute unit
+      const std::size_t GROUPS_PER_UNIT = 4;
+
+      std::size_t divideUp(std::size_t value, std::size_t divisor) {
+        return (value + divisor - 1) / divisor;
+      }
+
+      cl_uint checkedCount(std::size_t count) {
+        if (count > std::numeric_limits<cl_uint>::max()) {
+          throw mfl::Exception::build("Primitives take at most {} elements, got {}",
+                                      std::numeric_limits<cl_uint>::max(),
+                                      count);
+        }
+        return static_cast<cl_uint>(count);
+      }
+    }
+
+    const std::string PrimitivesProgram::getSource() const {
+      return SOURCE;
+    }
+
+    Primitives::Primitives(Runner & runner, std::size_t device) :
+        mRunner(runner),
+        mDevice(device) {
+      bind();
+    }
+
+    void Primitives::bind() {
+      auto & devices = mRunner.devices();
+      if (mDevice >= devices.size()) {
+        throw mfl::Exception::build("No device {} for primitives, only {} available",
+                                    mDevice,
+                                    devices.size());
+      }
+
+      auto & info = devices[mDevice];
+      auto limit = std::min(MAX_WORK_GROUP_SIZE, info.maxWorkGroupSize);
+      if (!info.maxWorkItemSizes.empty()) {
+        limit = std::min(limit, info.maxWorkItemSizes[0]);
+      }
+
+      // Largest power of two within the limits whose scan tile fits in
+      // local memory
+      mWorkGroupSize = 1;
+      while (mWorkGroupSize * 2 <= limit
+             && mWorkGroupSize * 4 * MAX_ELEMENT_SIZE <= info.localMemory) {
+        mWorkGroupSize *= 2;
+      }
+      mGroups = std::max<std::size_t>(info.computeUnits, 1) * GROUPS_PER_UNIT;
+      mLocalMemory = info.localMemory;
+
+      try {
+        mContext = mRunner.context();
+        mQueue = ::cl::CommandQueue(mContext, info.device);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    Runner::getErrorString(err.err()));
+      }
+      mKernels.clear();
+    }
+
+    void Primitives::refresh() {
+      if (mRunner.context()() != mContext()) {
+        bind();
+      }
+    }
+
+    ::cl::Kernel & Primitives::kernel(const std::string & name, const char * type) {
+      auto key = name + ':' + type;
+      auto kernel = mKernels.find(key);
+      if (kernel != mKernels.end()) {
+        return kernel->second;
+      }
+
+      auto built = mRunner.specialize(mProgram,
+                                      name,
+                                      Define("T", type),
+                                      Define("WG", static_cast<cl_uint>(mWorkGroupSize)));
+
+      auto device = mRunner.devices()[mDevice].device;
+      auto fits = built.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+      if (fits < mWorkGroupSize) {
+        throw mfl::Exception::build("Primitive {} runs at most {} work items per group, below the {} picked",
+                                    name,
+                                    fits,
+                                    mWorkGroupSize);
+      }
+      return mKernels.emplace(key, std::move(built)).first->second;
+    }
+
+    ::cl::Buffer Primitives::temporary(std::size_t bytes) {
+      return ::cl::Buffer(mRunner.context(), CL_MEM_READ_WRITE, std::max<std::size_t>(bytes, 1));
+    }
+
+    void Primitives::await(const std::vector<std::string> & names) const {
+      std::vector<::cl::Event> events;
+      for (auto & name : names) {
+        auto pending = mRunner.pendingEvents(name);
+        events.insert(events.end(), pending.begin(), pending.end());
+      }
+      if (!events.empty()) {
+        ::cl::Event::waitForEvents(events);
+      }
+    }
+
+    void Primitives::run(const ::cl::Kernel & kernel, std::size_t global, std::size_t local) {
+      mRunner.launch(mQueue,
+                     kernel,
+                     ::cl::NDRange(divideUp(global, local) * local),
+                     ::cl::NDRange(local));
+    }
+
+    void Primitives::reduce(const char * type,
+                            std::size_t size,
+                            const std::string & input,
+                            std::size_t count,
+                            void * result) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      refresh();
+
+      if (count == 0) {
+        std::memset(result, 0, size);
+        return;
+      }
+
+      try {
+        auto hold = mRunner.holdBuffers({input});
+        await({input});
+        auto elements = checkedCount(count);
+        auto groups = std::min(divideUp(count, mWorkGroupSize), mGroups);
+        auto partials = temporary(groups * size);
+
+        auto & sum = kernel("reduce", type);
+        sum.setArg(0, mRunner.getBuffer(input));
+        sum.setArg(1, partials);
+        sum.setArg(2, elements);
+        run(sum, groups * mWorkGroupSize, mWorkGroupSize);
+
+        if (groups > 1) {
+          sum.setArg(0, partials);
+          sum.setArg(1, partials);
+          sum.setArg(2, static_cast<cl_uint>(groups));
+          run(sum, mWorkGroupSize, mWorkGroupSize);
+        }
+
+        mQueue.enqueueReadBuffer(partials, CL_TRUE, 0, size, result);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    Runner::getErrorString(err.err()));
+      }
+    }
+
+    void Primitives::scan(const char * type,
+                          std::size_t size,
+                          const std::string & input,
+                          const std::string & output,
+                          std::size_t count,
+                          bool inclusive) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      refresh();
+
+      try {
+        auto hold = mRunner.holdBuffers({input, output});
+        await({input, output});
+        checkedCount(count);
+        scan(type, size, mRunner.getBuffer(input), mRunner.getBuffer(output), count, inclusive);
+        mQueue.finish();
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    Runner::getErrorString(err.err()));
+      }
+    }
+
+    void Primitives::scan(const char * type,
+                          std::size_t size,
+                          const ::cl::Buffer & input,
+                          const ::cl::Buffer & output,
+                          std::size_t count,
+                          bool inclusive) {
+      if (count == 0) {
+        return;
+      }
+
+      auto tile = 2 * mWorkGroupSize;
+      auto groups = divideUp(count, tile);
+      auto sums = temporary(groups * size);
+
+      auto & blocks = kernel("scan_blocks", type);
+      blocks.setArg(0, input);
+      blocks.setArg(1, output);
+      blocks.setArg(2, sums);
+      blocks.setArg(3, static_cast<cl_uint>(count));
+      blocks.setArg(4, static_cast<cl_uint>(inclusive));
+      run(blocks, groups * mWorkGroupSize, mWorkGroupSize);
+
+      if (groups > 1) {
+        scan(type, size, sums, sums, groups, false);
+
+        auto & offsets = kernel("add_offsets", type);
+        offsets.setArg(0, output);
+        offsets.setArg(1, sums);
+        offsets.setArg(2, static_cast<cl_uint>(count));
+        run(offsets, count, mWorkGroupSize);
+      }
+    }
+
+    std::size_t Primitives::compact(const char * type,
+                                    const std::string & input,
+                                    const std::string & flags,
+                                    const std::string & output,
+                                    std::size_t count) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      refresh();
+
+      if (count == 0) {
+        return 0;
+      }
+
+      try {
+        auto hold = mRunner.holdBuffers({input, flags, output});
+        await({input, flags, output});
+        auto elements = checkedCount(count);
+        ::cl::Buffer flagBuffer = mRunner.getBuffer(flags);
+        auto positions = temporary(count * sizeof(cl_uint));
+
+        // Any non-zero flag counts once, as scatter tests for non-zero
+        auto & normalize = kernel("normalize_flags", "uint");
+        normalize.setArg(0, flagBuffer);
+        normalize.setArg(1, positions);
+        normalize.setArg(2, elements);
+        run(normalize, count, mWorkGroupSize);
+        scan("uint", sizeof(cl_uint), positions, positions, count, false);
+
+        auto & scatter = kernel("scatter", type);
+        scatter.setArg(0, mRunner.getBuffer(input));
+        scatter.setArg(1, flagBuffer);
+        scatter.setArg(2, positions);
+        scatter.setArg(3, mRunner.getBuffer(output));
+        scatter.setArg(4, elements);
+        run(scatter, count, mWorkGroupSize);
+
+        cl_uint last[2];
+        auto offset = (count - 1) * sizeof(cl_uint);
+        mQueue.enqueueReadBuffer(positions, CL_FALSE, offset, sizeof(cl_uint), &last[0]);
+        mQueue.enqueueReadBuffer(flagBuffer, CL_TRUE, offset, sizeof(cl_uint), &last[1]);
+        return last[0] + (last[1] ? 1 : 0);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    Runner::getErrorString(err.err()));
+      }
+    }
+
+    void Primitives::radixSort(const std::string & keys, std::size_t count) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      refresh();
+
+      if (count < 2) {
+        return;
+      }
+
+      try {
+        auto hold = mRunner.holdBuffers({keys});
+        await({keys});
+        auto elements = checkedCount(count);
+        auto groups = divideUp(count, mWorkGroupSize);
+        auto counts = temporary(DIGITS * groups * sizeof(cl_uint));
+
+        ::cl::Buffer source = mRunner.getBuffer(keys);
+        auto destination = temporary(count * sizeof(cl_uint));
+
+        auto & countDigits = kernel("radix_count", "uint");
+        auto & scatter = kernel("radix_scatter", "uint");
+
+        // An even number of passes leaves the keys back in their buffer
+        for (cl_uint shift = 0; shift < 32; shift += 4) {
+          countDigits.setArg(0, source);
+          countDigits.setArg(1, counts);
+          countDigits.setArg(2, elements);
+          countDigits.setArg(3, shift);
+          run(countDigits, count, mWorkGroupSize);
+
+          scan("uint", sizeof(cl_uint), counts, counts, DIGITS * groups, false);
+
+          scatter.setArg(0, source);
+          scatter.setArg(1, destination);
+          scatter.setArg(2, counts);
+          scatter.setArg(3, elements);
+          scatter.setArg(4, shift);
+          run(scatter, count, mWorkGroupSize);
+
+          std::swap(source, destination);
+        }
+        mQueue.finish();
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    Runner::getErrorString(err.err()));
+      }
+    }
+
+    void Primitives::histogram(const std::string & input,
+                               std::size_t count,
+                               const std::string & bins,
+                               std::size_t binCount) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      refresh();
+
+      if (binCount == 0) {
+        return;
+      }
+
+      try {
+        auto hold = mRunner.holdBuffers({input, bins});
+        await({input, bins});
+        auto elements = checkedCount(count);
+        auto binElements = checkedCount(binCount);
+        ::cl::Buffer binBuffer = mRunner.getBuffer(bins);
+        mQueue.enqueueFillBuffer(binBuffer, cl_uint(0), 0, binCount * sizeof(cl_uint));
+
+        if (count > 0) {
+          auto groups = std::min(divideUp(count, mWorkGroupSize), mGroups);
+          if (binCount * sizeof(cl_uint) <= mLocalMemory) {
+            auto & binning = kernel("histogram", "uint");
+            binning.setArg(0, mRunner.getBuffer(input));
+            binning.setArg(1, binBuffer);
+            binning.setArg(2, ::cl::Local(binCount * sizeof(cl_uint)));
+            binning.setArg(3, elements);
+            binning.setArg(4, binElements);
+            run(binning, groups * mWorkGroupSize, mWorkGroupSize);
+          } else {
+            auto & binning = kernel("histogram_global", "uint");
+            binning.setArg(0, mRunner.getBuffer(input));
+            binning.setArg(1, binBuffer);
+            binning.setArg(2, elements);
+            binning.setArg(3, binElements);
+            run(binning, groups * mWorkGroupSize, mWorkGroupSize);
+          }
+        }
+        mQueue.finish();
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    Runner::getErrorString(err.err()));
+      }
+    }
+  }
+}
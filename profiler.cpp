@@ -0,0 +1,135 @@
+#include "include/mfl/cl/profiler.hpp"
+
+#include <algorithm>
+
+namespace mfl {
+  namespace cl {
+
+    namespace {
+      const std::size_t COLLECT_THRESHOLD = 1024;
+
+      std::size_t mostSignificantBit(std::uint64_t value) {
+        std::size_t bit = 0;
+        while (value >>= 1) {
+          bit++;
+        }
+        return bit;
+      }
+    }
+
+    void Profiler::Histogram::add(std::uint64_t value) {
+      std::size_t index;
+      if (value < SUB_BUCKETS) {
+        index = value;
+      } else {
+        auto bit = mostSignificantBit(value);
+        index = (bit - 3) * SUB_BUCKETS + ((value >> (bit - 4)) & (SUB_BUCKETS - 1));
+      }
+      mBuckets[index]++;
+    }
+
+    std::uint64_t Profiler::Histogram::percentile(double fraction) const {
+      std::uint64_t total = 0;
+      for (auto count : mBuckets) {
+        total += count;
+      }
+
+      if (total == 0) {
+        return 0;
+      }
+
+      auto rank = static_cast<std::uint64_t>(fraction * (total - 1)) + 1;
+      for (std::size_t index = 0; index < mBuckets.size(); ++index) {
+        if (mBuckets[index] >= rank) {
+          if (index < SUB_BUCKETS) {
+            return index;
+          }
+
+          auto shift = index / SUB_BUCKETS - 1;
+          auto lower = (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+          return lower + ((std::uint64_t(1) << shift) >> 1);
+        }
+        rank -= mBuckets[index];
+      }
+      return 0;
+    }
+
+    void Profiler::record(const std::string & kernel,
+                          const ::cl::Event & event,
+                          std::uint64_t enqueueNanoseconds) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mPending.push_back(Pending{kernel, event, enqueueNanoseconds});
+
+      if (mPending.size() >= COLLECT_THRESHOLD) {
+        collect();
+      }
+    }
+
+    void Profiler::collect() {
+      // Events of queues without profiling throw on getProfilingInfo, and
+      // are dropped rather than left to throw on every later collect
+      auto pending = std::remove_if(mPending.begin(), mPending.end(), [this](Pending & launch) {
+        try {
+          auto status = launch.event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+          if (status > CL_COMPLETE) {
+            return false;
+          }
+
+          if (status == CL_COMPLETE) {
+            auto queued = launch.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+            auto submit = launch.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+            auto start = launch.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            auto end = launch.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+            auto & entry = mKernels[launch.kernel];
+            entry.device.add(end - start);
+            entry.count++;
+            entry.totalDevice += end - start;
+            entry.totalQueued += submit - queued;
+            entry.totalSubmitted += start - submit;
+            entry.totalEnqueue += launch.enqueue;
+          }
+        } catch (::cl::Error &) {
+        }
+        return true;
+      });
+      mPending.erase(pending, mPending.end());
+    }
+
+    std::vector<KernelStatistics> Profiler::statistics() {
+      std::lock_guard<std::mutex> lock(mMutex);
+      collect();
+
+      std::vector<KernelStatistics> statistics;
+      statistics.reserve(mKernels.size());
+      for (auto & kernel : mKernels) {
+        statistics.push_back(KernelStatistics{kernel.first,
+                                              kernel.second.count,
+                                              kernel.second.device.percentile(0.5),
+                                              kernel.second.device.percentile(0.99),
+                                              kernel.second.totalDevice,
+                                              kernel.second.totalQueued,
+                                              kernel.second.totalSubmitted,
+                                              kernel.second.totalEnqueue});
+      }
+
+      std::sort(statistics.begin(),
+                statistics.end(),
+                [](const KernelStatistics & a, const KernelStatistics & b) {
+                  return a.totalDevice > b.totalDevice;
+                });
+      return statistics;
+    }
+
+    std::size_t Profiler::pending() const {
+      std::lock_guard<std::mutex> lock(mMutex);
+      return mPending.size();
+    }
+
+    void Profiler::reset() {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mPending.clear();
+      mKernels.clear();
+    }
+  }
+}
@@ -1,14 +1,96 @@
 #include "include/mfl/cl/runner.hpp"
+#include "include/mfl/cl/util.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <numeric>
+#include <thread>
+#include <unordered_set>
 
 namespace mfl {
   namespace cl {
 
+    namespace {
+      std::atomic<std::uint64_t> nextRunnerId(1);
+
+      void CL_CALLBACK freeHostMemory(cl_mem, void * data) {
+        delete[] static_cast<char *>(data);
+      }
+
+      std::size_t greatestCommonDivisor(std::size_t a, std::size_t b) {
+        while (b != 0) {
+          auto rest = a % b;
+          a = b;
+          b = rest;
+        }
+        return a;
+      }
+    }
+
     Runner::Runner(cl_device_type type,
                    bool verbose,
-                   const std::vector<const char *> & requirements) {
+                   const std::vector<const char *> & requirements,
+                   const DeviceScore & score) :
+        Runner(false, type, verbose, requirements, score) {
+      discover();
+    }
+
+    Runner::Runner(Deferred,
+                   cl_device_type type,
+                   bool verbose,
+                   const std::vector<const char *> & requirements,
+                   const DeviceScore & score) :
+        Runner(true, type, verbose, requirements, score) {}
+
+    Runner::Runner(bool deferred,
+                   cl_device_type type,
+                   bool verbose,
+                   const std::vector<const char *> & requirements,
+                   const DeviceScore & score) :
+        mId(nextRunnerId++),
+        mProgramEpoch(0),
+        mDeferred(deferred),
+        mType(type),
+        mVerbose(verbose),
+        mRequirements(requirements.begin(), requirements.end()),
+        mScore(score),
+        mCreated(std::chrono::steady_clock::now()),
+        mFirstKernel(0),
+        mDiscovered(false),
+        mSpecializations(64),
+        mTrackedNext(0) {}
+
+    Runner::~Runner() {
+      if (mPrewarm.joinable()) {
+        mPrewarm.join();
+      }
+
+      // Threads drop the emptied caches the next time they make a kernel
+      std::lock_guard<std::mutex> lock(mThreadKernelsMutex);
+      for (auto & registered : mThreadKernels) {
+        if (auto cache = registered.lock()) {
+          cache->alive = false;
+          cache->kernels.clear();
+        }
+      }
+    }
+
+    void Runner::discover() const {
+      if (mDiscovered.load(std::memory_order_acquire)) {
+        return;
+      }
+
+      std::lock_guard<std::mutex> discoveryLock(mDiscoveryMutex);
+      if (mDiscovered.load(std::memory_order_relaxed)) {
+        return;
+      }
+
+      TraceScope trace("device", "discover");
       try {
         std::vector<::cl::Platform> platforms;
         ::cl::Platform::get(&platforms);
@@ -17,89 +99,40 @@ namespace mfl {
           throw mfl::Exception::build("OpenCL platforms not found");
         }
 
-        if (verbose) {
+        if (mVerbose) {
           mfl::out::println("Detecting best platform..");
         }
 
-        std::vector<::cl::Device> platformDevices;
-        size_t bestCount = 0;
-        int bestIndex = 0;
-        for (std::size_t i = 0; i < platforms.size(); ++i) {
-          platforms[i].getDevices(type, &platformDevices);
-          auto deviceCount = platformDevices.size();
-
-          if (!requirements.empty()) {
-            for (auto device : platformDevices) {
-              std::string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
-              for (const char * requirement : requirements) {
-                if (extensions.find(requirement) == std::string::npos) {
-                  deviceCount--;
-                  break;
-                }
-              }
-            }
-          }
-
-          if (deviceCount > bestCount) {
-            bestCount = deviceCount;
-            bestIndex = i;
-          }
+        std::vector<const char *> requirements;
+        for (auto & requirement : mRequirements) {
+          requirements.push_back(requirement.c_str());
         }
 
-        if (bestCount == 0) {
+        auto bestIndex = selectDevices(platforms, mType, requirements, mScore, mDeviceInfo);
+        if (bestIndex < 0) {
           throw mfl::Exception::build("No compatible OpenCL device found");
         }
 
-        if (verbose) {
+        if (mVerbose) {
           mfl::out::println("Chose {} with {} compatible device{}",
                             platforms[bestIndex].getInfo<CL_PLATFORM_NAME>(),
-                            bestCount,
-                            bestCount > 1 ? 's' : ' ');
+                            mDeviceInfo.size(),
+                            mDeviceInfo.size() > 1 ? 's' : ' ');
         }
 
         mTotalMemory = SIZE_MAX;
         mBufferMemory = SIZE_MAX;
-        mDevices.reserve(bestCount);
-        if (requirements.empty()) {
-          platforms[bestIndex].getDevices(type, &mDevices);
-
-          for (auto device : mDevices) {
-            auto memory = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
-            if (memory < mTotalMemory) {
-              mTotalMemory = memory;
-            }
-
-            memory = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
-            if (memory < mBufferMemory) {
-              mBufferMemory = memory;
-            }
-          }
-        } else {
-          platforms[bestIndex].getDevices(type, &platformDevices);
-          for (auto device : platformDevices) {
-            std::string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
-            bool compatible = true;
-            for (const char * requirement : requirements) {
-              if (extensions.find(requirement) == std::string::npos) {
-                compatible = false;
-                break;
-              }
-            }
-            if (compatible) {
-              mDevices.push_back(device);
-              auto memory = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
-              if (memory < mTotalMemory) {
-                mTotalMemory = memory;
-              }
-
-              memory = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
-              if (memory < mBufferMemory) {
-                mBufferMemory = memory;
-              }
-            }
-          }
+        mZeroCopy = true;
+        mDevices.clear();
+        mDevices.reserve(mDeviceInfo.size());
+        for (auto & info : mDeviceInfo) {
+          mDevices.push_back(info.device);
+          mTotalMemory = std::min(mTotalMemory, info.globalMemory);
+          mBufferMemory = std::min(mBufferMemory, info.maxAllocation);
+          mZeroCopy = mZeroCopy && info.unifiedMemory;
         }
 
+        mPlatform = platforms[bestIndex];
         mContext = ::cl::Context(mDevices);
       } catch (::cl::Error & err) {
         throw mfl::Exception::build("OpenCL error: {} ({} : {})",
@@ -107,67 +140,174 @@ namespace mfl {
                                     err.err(),
                                     getErrorString(err.err()));
       }
+
+      mBudget = mTotalMemory;
+      mDiscovered.store(true, std::memory_order_release);
     }
 
-    void Runner::loadProgram(const Program & program, bool verbose) {
-      if (mDevices.empty()) {
-        throw mfl::Exception::build("Trying to load program without devices");
+    bool Runner::hasProgram(const std::string & name) const {
+      std::lock_guard<std::mutex> lock(mDeferredMutex);
+      return mPrograms.contains(name) || mDeferredPrograms.count(name) > 0;
+    }
+
+    BuildLog Runner::deferProgram(const Program & program, bool verbose) {
+      {
+        std::lock_guard<std::mutex> lock(mDeferredMutex);
+        if (mPrograms.contains(program.name()) || mDeferredPrograms.count(program.name())) {
+          throw mfl::Exception::build("Trying to create a program with an"
+                                          "existing name");
+        }
+
+        auto deferred = std::make_shared<DeferredProgram>();
+        deferred->program = &program;
+        deferred->verbose = verbose;
+        mDeferredPrograms.emplace(program.name(), std::move(deferred));
       }
 
-      if (mPrograms.find(program.name()) != mPrograms.end()) {
-        throw mfl::Exception::build("Trying to create a program with an"
-                                        "existing name");
+      BuildLog log;
+      log.program = program.name();
+      log.cached = false;
+      log.format = "deferred";
+      log.createNanoseconds = 0;
+      log.buildNanoseconds = 0;
+      return log;
+    }
+
+    void Runner::buildDeferred(DeferredProgram & deferred) {
+      std::lock_guard<std::mutex> buildLock(deferred.mutex);
+      std::string name = deferred.program->name();
+
+      auto current = [&]() {
+        auto entry = mDeferredPrograms.find(name);
+        return entry != mDeferredPrograms.end() && entry->second.get() == &deferred;
+      };
+
+      // Built by an earlier holder of the lock, or released
+      {
+        std::lock_guard<std::mutex> lock(mDeferredMutex);
+        if (!current()) {
+          return;
+        }
       }
 
+      discover();
+      BuildLog log;
+      ::cl::Program built;
       try {
-        auto clProgram = ::cl::Program(mContext, program.getSource());
+        built = buildProgram(*deferred.program, log);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
 
-        bool titleShown = false;
+      if (deferred.verbose) {
+        printBuildLog(*deferred.program, log);
+      }
 
-        for (auto device : mDevices) {
-          auto buildInfo = clProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-          if (verbose && buildInfo.size() > 1) {
-            if (!titleShown) {
-              mfl::out::println("Build log for {} ({})", program.name(), program.path());
-              titleShown = true;
-            }
+      std::lock_guard<std::mutex> lock(mDeferredMutex);
+      if (current()) {
+        insertProgram(name, std::move(built));
+        mDeferredPrograms.erase(name);
+      }
+    }
 
-            mfl::out::println("== Device {}:\n"
-                                  "{}\n"
-                                  "=========",
-                              device.getInfo<CL_DEVICE_NAME>(),
-                              buildInfo);
+    bool Runner::findProgram(const std::string & name, ::cl::Program & program) {
+      if (!mPrograms.find(name, program)) {
+        std::shared_ptr<DeferredProgram> deferred;
+        {
+          std::lock_guard<std::mutex> lock(mDeferredMutex);
+          auto entry = mDeferredPrograms.find(name);
+          if (entry == mDeferredPrograms.end()) {
+            return false;
           }
+          deferred = entry->second;
         }
 
-        try {
-          clProgram.build(mDevices, program.buildString());
+        buildDeferred(*deferred);
+        if (!mPrograms.find(name, program)) {
+          return false;
+        }
+      }
 
-#if defined(DEBUG) || defined(_DEBUG)
-          auto assembly = clProgram.getInfo<CL_PROGRAM_BINARIES>();
-          mfl::out::println();
-          mfl::out::println("== Assembly:");
-          for (auto line : assembly) {
-            mfl::out::println("{}", line);
+      if (mFirstKernel.load(std::memory_order_relaxed) == 0) {
+        std::uint64_t elapsed = std::max<std::int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - mCreated).count(),
+            1);
+        std::uint64_t none = 0;
+        if (mFirstKernel.compare_exchange_strong(none, elapsed) && mVerbose) {
+          mfl::out::println("Time to first kernel: {} ms", elapsed / 1e6);
+        }
+      }
+      return true;
+    }
+
+    void Runner::prewarm() {
+      std::call_once(mPrewarmOnce, [this]() {
+        mPrewarm = std::thread([this]() {
+          std::vector<std::shared_ptr<DeferredProgram>> pending;
+          try {
+            discover();
+            std::lock_guard<std::mutex> lock(mDeferredMutex);
+            for (auto & entry : mDeferredPrograms) {
+              pending.push_back(entry.second);
+            }
+          } catch (std::exception & ex) {
+            if (mVerbose) {
+              mfl::out::println(stderr, "Could not prewarm: {}", ex.what());
+            }
+            return;
+          } catch (...) {
+            return;
           }
-#endif
 
-          mPrograms[program.name()] = std::move(clProgram);
-        } catch (::cl::Error & err) {
-          if (err.err() == CL_INVALID_PROGRAM_EXECUTABLE
-              || err.err() == CL_BUILD_ERROR
-              || err.err() == CL_BUILD_PROGRAM_FAILURE) {
-            for (auto device : mDevices) {
-              mfl::out::println(stderr,
-                                "Build failure\n{}",
-                                clProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device));
+          // The first use builds again and throws the error to its caller
+          for (auto & deferred : pending) {
+            try {
+              buildDeferred(*deferred);
+            } catch (std::exception & ex) {
+              if (mVerbose || deferred->verbose) {
+                mfl::out::println(stderr,
+                                  "Could not prewarm {}: {}",
+                                  deferred->program->name(),
+                                  ex.what());
+              }
+            } catch (...) {
             }
           }
-          throw mfl::Exception::build("OpenCL error: {} ({} : {})",
-                                      err.what(),
-                                      err.err(),
-                                      getErrorString(err.err()));
+        });
+      });
+    }
+
+    BuildLog Runner::loadProgram(const Program & program, bool verbose) {
+      if (mDeferred) {
+        return deferProgram(program, verbose);
+      }
+
+      if (mDevices.empty()) {
+        throw mfl::Exception::build("Trying to load program without devices");
+      }
+
+      if (hasProgram(program.name())) {
+        throw mfl::Exception::build("Trying to create a program with an"
+                                        "existing name");
+      }
+
+      BuildLog log;
+      try {
+        auto clProgram = buildProgram(program, log);
+        if (verbose) {
+          printBuildLog(program, log);
+        }
+
+        // Another thread may have registered the name while this one built
+        if (!insertProgram(program.name(), std::move(clProgram))) {
+          throw mfl::Exception::build("Trying to create a program with an"
+                                          "existing name");
         }
+        return log;
       } catch (::cl::Error & err) {
         throw mfl::Exception::build("OpenCL error: {} ({} : {})",
                                     err.what(),
@@ -176,95 +316,2047 @@ namespace mfl {
       }
     }
 
-    void Runner::releaseProgram(const std::string & name) {
-      mPrograms.erase(name);
+    void Runner::enableBinaryCache(const std::string & directory) {
+      if (!util::makeDirectories(directory)) {
+        throw mfl::Exception::build("Could not create the binary cache directory {}",
+                                    directory);
+      }
+      mBinaryCache.reset(new BinaryCache(directory));
     }
 
-    std::vector<::cl::CommandQueue> Runner::commandQueues(std::size_t deviceCount) {
-      if (deviceCount <= 0) {
-        return std::vector<::cl::CommandQueue>(0);
+    std::vector<BuildLog> Runner::loadPrograms(const std::vector<const Program *> & programs,
+                                               bool verbose) {
+      if (!mDeferred && mDevices.empty()) {
+        throw mfl::Exception::build("Trying to load program without devices");
       }
 
-      if (mCommands.size() < deviceCount) {
-        mCommands.reserve(deviceCount);
+      std::unordered_set<std::string> names;
+      for (auto program : programs) {
+        if (hasProgram(program->name())
+            || !names.insert(program->name()).second) {
+          throw mfl::Exception::build("Trying to create a program with an"
+                                          "existing name: {}",
+                                      program->name());
+        }
+      }
 
-        try {
-          for (size_t i = mCommands.size(); i < deviceCount; ++i) {
-            mCommands.emplace_back(mContext, mDevices[i]);
+      if (mDeferred) {
+        std::vector<BuildLog> logs;
+        for (auto program : programs) {
+          logs.push_back(deferProgram(*program, verbose));
+        }
+        return logs;
+      }
+
+      std::vector<::cl::Program> built(programs.size());
+      std::vector<BuildLog> logs(programs.size());
+      std::vector<std::exception_ptr> failures(programs.size());
+      std::atomic<std::size_t> next(0);
+
+      auto worker = [&]() {
+        for (auto i = next++; i < programs.size(); i = next++) {
+          try {
+            built[i] = buildProgram(*programs[i], logs[i]);
+          } catch (...) {
+            failures[i] = std::current_exception();
+          }
+        }
+      };
+
+      std::size_t threadCount = std::min<std::size_t>(
+          std::max(std::thread::hardware_concurrency(), 1u),
+          programs.size());
+      std::vector<std::thread> threads;
+      threads.reserve(threadCount);
+      for (std::size_t i = 1; i < threadCount; ++i) {
+        threads.emplace_back(worker);
+      }
+      worker();
+      for (auto & thread : threads) {
+        thread.join();
+      }
+
+      std::exception_ptr failure;
+      std::vector<std::string> clashes;
+      for (std::size_t i = 0; i < programs.size(); ++i) {
+        if (verbose) {
+          printBuildLog(*programs[i], logs[i]);
+        }
+
+        if (failures[i]) {
+          if (!failure) {
+            failure = failures[i];
           }
+        } else if (!insertProgram(programs[i]->name(), std::move(built[i]))) {
+          clashes.push_back(programs[i]->name());
+        }
+      }
+
+      if (!clashes.empty() && !failure) {
+        throw mfl::Exception::build("Trying to create a program with an"
+                                        "existing name: {}",
+                                    clashes.front());
+      }
+
+      if (failure) {
+        try {
+          std::rethrow_exception(failure);
         } catch (::cl::Error & err) {
           throw mfl::Exception::build("OpenCL error: {} ({} : {})",
                                       err.what(),
                                       err.err(),
                                       getErrorString(err.err()));
         }
+      }
 
-        if (mCommands.size() < deviceCount) {
-          throw mfl::Exception::build("Could not create command queues");
+      return logs;
+    }
+
+    ::cl::Program Runner::buildProgram(const Program & program, BuildLog & log) {
+      TraceScope trace("build", program.name());
+
+      std::vector<std::string> keys;
+
+      log.program = program.name();
+      log.cached = false;
+      log.format = "source";
+      log.createNanoseconds = 0;
+      log.buildNanoseconds = 0;
+      log.devices.clear();
+
+      auto now = [] {
+        return std::chrono::steady_clock::now();
+      };
+      auto since = [&](std::chrono::steady_clock::time_point start) {
+        return static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now() - start).count());
+      };
+
+      auto il = program.getIL();
+      auto modules = program.modules();
+
+      if (mBinaryCache) {
+        keys = binaryCacheKeys(program, il);
+
+        std::vector<std::string> binaries;
+        if (mBinaryCache->load(keys, binaries)) {
+          ::cl::Program::Binaries blobs;
+          blobs.reserve(binaries.size());
+          for (auto & binary : binaries) {
+            blobs.emplace_back(binary.data(), binary.size());
+          }
+
+          try {
+            auto start = now();
+            ::cl::Program clProgram(mContext, mDevices, blobs);
+            log.createNanoseconds = since(start);
+            start = now();
+            clProgram.build(mDevices, program.buildString());
+            log.buildNanoseconds = since(start);
+            log.cached = true;
+            log.format = "cache";
+            return clProgram;
+          } catch (::cl::Error &) {
+            mBinaryCache->reject(keys);
+          }
         }
       }
 
-      return std::vector<::cl::CommandQueue>(mCommands.cbegin(),
-                                             mCommands.cbegin() + deviceCount);
+      // Offline binaries only help when every device has one
+      std::vector<std::string> binaries;
+      for (auto & info : mDeviceInfo) {
+        binaries.push_back(program.getBinary(info.name));
+        if (binaries.back().empty()) {
+          binaries.clear();
+          break;
+        }
+      }
+
+      if (!binaries.empty()) {
+        ::cl::Program::Binaries blobs;
+        for (auto & binary : binaries) {
+          blobs.emplace_back(binary.data(), binary.size());
+        }
+
+        try {
+          auto start = now();
+          ::cl::Program clProgram(mContext, mDevices, blobs);
+          log.createNanoseconds = since(start);
+          start = now();
+          clProgram.build(mDevices, program.buildString());
+          log.buildNanoseconds = since(start);
+          log.format = "binary";
+          return clProgram;
+        } catch (::cl::Error & err) {
+          if (mVerbose) {
+            mfl::out::println(stderr,
+                              "Offline binaries of {} were refused ({}), building it again",
+                              program.name(),
+                              getErrorString(err.err()));
+          }
+        }
+      }
+
+      ::cl::Program clProgram;
+      bool fromIL = !il.empty();
+      for (auto & info : mDeviceInfo) {
+        fromIL = fromIL && info.supports("cl_khr_il_program");
+      }
+
+      if (fromIL) {
+        typedef cl_program (CL_API_CALL * CreateProgramWithILKHR)(cl_context,
+                                                                  const void *,
+                                                                  std::size_t,
+                                                                  cl_int *);
+        auto create = reinterpret_cast<CreateProgramWithILKHR>(
+            clGetExtensionFunctionAddressForPlatform(mPlatform(), "clCreateProgramWithILKHR"));
+
+        cl_int error = CL_INVALID_OPERATION;
+        auto start = now();
+        auto handle = create ? create(mContext(), il.data(), il.size(), &error) : nullptr;
+        if (error == CL_SUCCESS) {
+          clProgram = ::cl::Program(handle);
+          log.createNanoseconds = since(start);
+          log.format = "il";
+        }
+      }
+
+      bool linked = false;
+      if (!clProgram()) {
+        auto start = now();
+        clProgram = ::cl::Program(mContext, program.getSource());
+        log.createNanoseconds = since(start);
+        log.format = "source";
+        linked = !modules.empty();
+      }
+
+      try {
+        auto start = now();
+        if (linked) {
+          linkModules(program, modules, clProgram);
+        } else {
+          clProgram.build(mDevices, program.buildString());
+        }
+        log.buildNanoseconds = since(start);
+
+#if defined(DEBUG) || defined(_DEBUG)
+        auto assembly = clProgram.getInfo<CL_PROGRAM_BINARIES>();
+        mfl::out::println();
+        mfl::out::println("== Assembly:");
+        for (auto line : assembly) {
+          mfl::out::println("{}", line);
+        }
+#endif
+      } catch (::cl::Error & err) {
+        for (auto & info : mDeviceInfo) {
+          log.devices.emplace_back(info.name,
+                                   clProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(info.device));
+        }
+
+        if (err.err() == CL_INVALID_PROGRAM_EXECUTABLE
+            || err.err() == CL_BUILD_ERROR
+            || err.err() == CL_BUILD_PROGRAM_FAILURE) {
+          for (auto & device : log.devices) {
+            mfl::out::println(stderr, "Build failure\n{}", device.second);
+          }
+        }
+        throw;
+      }
+
+      for (auto & info : mDeviceInfo) {
+        log.devices.emplace_back(info.name,
+                                 clProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(info.device));
+      }
+
+      if (mBinaryCache
+          && !mBinaryCache->store(keys, programBinaries(clProgram))
+          && mVerbose) {
+        mfl::out::println(stderr,
+                          "Could not store {} in the binary cache at {}",
+                          program.name(),
+                          mBinaryCache->directory());
+      }
+
+      return clProgram;
     }
 
-    void Runner::releaseQueues() {
-      mCommands = std::vector<::cl::CommandQueue>(0);
+    void Runner::compile(const ::cl::Program & program,
+                         const char * options,
+                         const std::vector<cl_program> & headers,
+                         std::vector<const char *> headerNames) const {
+      std::vector<cl_device_id> devices;
+      for (auto & device : mDevices) {
+        devices.push_back(device());
+      }
+
+      auto status = clCompileProgram(program(),
+                                     static_cast<cl_uint>(devices.size()),
+                                     devices.data(),
+                                     options,
+                                     static_cast<cl_uint>(headers.size()),
+                                     headers.empty() ? nullptr : headers.data(),
+                                     headerNames.empty() ? nullptr : headerNames.data(),
+                                     nullptr,
+                                     nullptr);
+      if (status != CL_SUCCESS) {
+        throw ::cl::Error(status, "clCompileProgram");
+      }
     }
 
-    ::cl::Kernel Runner::makeKernel(const std::string & program,
-                                    const std::string & kernelName,
-                                    bool verbose) {
+    std::shared_ptr<Runner::CompiledModule> Runner::compileModule(const Module & module) {
+      auto header = module.getHeader();
+      auto source = module.getSource();
+      // The header's length keeps any header and source pair apart
+      auto key = std::string(module.name())
+          + '\0' + module.buildString()
+          + '\0' + std::to_string(header.size())
+          + '\0' + header
+          + source;
 
-      auto builtProgram = mPrograms.find(program);
-      if (builtProgram == mPrograms.end()) {
-        throw mfl::Exception::build("No program named {} has been loaded yet",
-                                    program);
+      std::shared_ptr<CompiledModule> compiled;
+      {
+        std::lock_guard<std::mutex> lock(mModulesMutex);
+        auto & entry = mModules[key];
+        if (!entry) {
+          entry = std::make_shared<CompiledModule>();
+        }
+        compiled = entry;
       }
 
-      ::cl::Kernel kernel(builtProgram->second, kernelName.c_str());
+      std::lock_guard<std::mutex> lock(compiled->mutex);
+      if (compiled->object()) {
+        return compiled;
+      }
 
-      if (verbose) {
-        for (auto device : mDevices) {
-          mfl::out::println("Kernel info for {}", device.getInfo<CL_DEVICE_NAME>());
-          auto compileWorkGroupSize =
-              kernel.getWorkGroupInfo<CL_KERNEL_COMPILE_WORK_GROUP_SIZE>(device);
-          mfl::out::println(" * Compile work group size:        {}, {}, {}",
-                            compileWorkGroupSize[0],
-                            compileWorkGroupSize[1],
-                            compileWorkGroupSize[2]);
-          size_t globalSize[3];
-          clGetKernelWorkGroupInfo(kernel(),
-                                   device(),
-                                   CL_KERNEL_GLOBAL_WORK_SIZE,
-                                   sizeof(globalSize),
-                                   globalSize,
-                                   0);
-          mfl::out::println(" * Global work size:               {}, {}, {}",
-                            globalSize[0],
-                            globalSize[1],
-                            globalSize[2]);
-          mfl::out::println(" * Local memory size:              {}B",
-                            kernel.getWorkGroupInfo
-                                <CL_KERNEL_LOCAL_MEM_SIZE>(device));
-          mfl::out::println(" * Preferred group size multiple:  {}",
-                            kernel.getWorkGroupInfo
-                                <CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device));
-          mfl::out::println(" * Private memory size:            {}B",
-                            kernel.getWorkGroupInfo
-                                <CL_KERNEL_PRIVATE_MEM_SIZE>(device));
-          mfl::out::println(" * Work group size:                {}",
-                            kernel.getWorkGroupInfo
-                                <CL_KERNEL_WORK_GROUP_SIZE>(device));
-          mfl::out::println();
+      TraceScope trace("build", module.name());
+
+      ::cl::Program headerProgram;
+      std::vector<cl_program> headers;
+      std::vector<const char *> headerNames;
+      if (!header.empty()) {
+        headerProgram = ::cl::Program(mContext, header);
+        headers.push_back(headerProgram());
+        headerNames.push_back(module.name());
+      }
+
+      ::cl::Program object(mContext, source);
+      try {
+        compile(object, module.buildString(), headers, headerNames);
+      } catch (::cl::Error &) {
+        for (auto & info : mDeviceInfo) {
+          mfl::out::println(stderr,
+                            "Build failure in module {}\n{}",
+                            module.name(),
+                            object.getBuildInfo<CL_PROGRAM_BUILD_LOG>(info.device));
         }
+        throw;
       }
 
-      return kernel;
+      compiled->header = std::move(headerProgram);
+      compiled->object = std::move(object);
+      return compiled;
     }
 
-    void Runner::releaseBuffer(const std::string & name) {
-      mBuffers.erase(name);
+    void Runner::linkModules(const Program & program,
+                             const std::vector<const Module *> & modules,
+                             ::cl::Program & clProgram) {
+      std::vector<std::shared_ptr<CompiledModule>> compiled;
+      std::vector<cl_program> headers;
+      std::vector<const char *> headerNames;
+      std::vector<cl_program> objects{clProgram()};
+      for (auto module : modules) {
+        compiled.push_back(compileModule(*module));
+        if (compiled.back()->header()) {
+          headers.push_back(compiled.back()->header());
+          headerNames.push_back(module->name());
+        }
+        objects.push_back(compiled.back()->object());
+      }
+
+      compile(clProgram, program.buildString(), headers, headerNames);
+
+      std::vector<cl_device_id> devices;
+      for (auto & device : mDevices) {
+        devices.push_back(device());
+      }
+
+      cl_int status = CL_SUCCESS;
+      auto handle = clLinkProgram(mContext(),
+                                  static_cast<cl_uint>(devices.size()),
+                                  devices.data(),
+                                  nullptr,
+                                  static_cast<cl_uint>(objects.size()),
+                                  objects.data(),
+                                  nullptr,
+                                  nullptr,
+                                  &status);
+      // A failed link may still return a program holding the link log
+      if (handle) {
+        clProgram = ::cl::Program(handle);
+      }
+      if (status != CL_SUCCESS) {
+        throw ::cl::Error(status, "clLinkProgram");
+      }
+    }
+
+    void Runner::printBuildLog(const Program & program, const BuildLog & log) {
+      mfl::out::println("Loaded {} ({}) from {} in {}us (create {}us, build {}us)",
+                        program.name(),
+                        program.path(),
+                        log.format,
+                        (log.createNanoseconds + log.buildNanoseconds) / 1000,
+                        log.createNanoseconds / 1000,
+                        log.buildNanoseconds / 1000);
+      if (log.cached) {
+        return;
+      }
+
+      bool titleShown = false;
+      for (auto & device : log.devices) {
+        if (device.second.size() > 1) {
+          if (!titleShown) {
+            mfl::out::println("Build log for {} ({})", program.name(), program.path());
+            titleShown = true;
+          }
+
+          mfl::out::println("== Device {}:\n"
+                                "{}\n"
+                                "=========",
+                            device.first,
+                            device.second);
+        }
+      }
+    }
+
+    std::vector<std::string> Runner::binaryCacheKeys(const Program & program,
+                                                     const std::string & il) const {
+      std::string common;
+      common += program.getSource();
+      common += '\0';
+      common += il;
+      common += '\0';
+      common += program.buildString();
+      for (auto module : program.modules()) {
+        common += '\0';
+        common += module->name();
+        common += '\0';
+        common += module->buildString();
+        common += '\0';
+        common += module->getHeader();
+        common += '\0';
+        common += module->getSource();
+      }
+      common += '\0';
+      common += mPlatform.getInfo<CL_PLATFORM_NAME>();
+      common += '\0';
+      common += mPlatform.getInfo<CL_PLATFORM_VERSION>();
+
+      std::vector<std::string> keys;
+      keys.reserve(mDevices.size());
+      for (auto & device : mDevices) {
+        keys.push_back(common
+                           + '\0' + device.getInfo<CL_DEVICE_NAME>()
+                           + '\0' + device.getInfo<CL_DEVICE_VERSION>()
+                           + '\0' + device.getInfo<CL_DRIVER_VERSION>());
+      }
+      return keys;
+    }
+
+    std::vector<std::string> Runner::programBinaries(const ::cl::Program & program) const {
+      auto sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+
+      std::vector<std::string> binaries(sizes.size());
+      std::vector<unsigned char *> pointers(sizes.size());
+      for (std::size_t i = 0; i < sizes.size(); ++i) {
+        binaries[i].resize(sizes[i]);
+        pointers[i] = reinterpret_cast<unsigned char *>(&binaries[i][0]);
+      }
+
+      if (clGetProgramInfo(program(),
+                           CL_PROGRAM_BINARIES,
+                           pointers.size() * sizeof(unsigned char *),
+                           pointers.data(),
+                           0) != CL_SUCCESS) {
+        return std::vector<std::string>(0);
+      }
+      return binaries;
+    }
+
+    void Runner::releaseProgram(const std::string & name) {
+      {
+        std::lock_guard<std::mutex> lock(mDeferredMutex);
+        mDeferredPrograms.erase(name);
+      }
+      ::cl::Program program;
+      if (mPrograms.find(name, program)) {
+        std::lock_guard<std::mutex> lock(mProgramNamesMutex);
+        mProgramNames.erase(program());
+      }
+      mPrograms.erase(name);
+      mProgramEpoch++;
+    }
+
+    bool Runner::insertProgram(const std::string & name, ::cl::Program && program) {
+      auto handle = program();
+      if (!mPrograms.insert(name, std::move(program))) {
+        return false;
+      }
+
+      std::lock_guard<std::mutex> lock(mProgramNamesMutex);
+      mProgramNames[handle] = name;
+      return true;
+    }
+
+    ::cl::Kernel Runner::specialize(const Program & program,
+                                    const std::string & kernelName,
+                                    const std::vector<Define> & defines) {
+      discover();
+      if (mDevices.empty()) {
+        throw mfl::Exception::build("Trying to load program without devices");
+      }
+
+      try {
+        auto built = mSpecializations.get(program,
+                                          defines,
+                                          [this](const Program & variant) {
+                                            BuildLog log;
+                                            return buildProgram(variant, log);
+                                          });
+        return ::cl::Kernel(built, kernelName.c_str());
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    ::cl::Kernel & Runner::threadKernel(const std::string & program,
+                                        const std::string & kernelName) {
+      // Keyed by runner id rather than address so a new Runner at a recycled
+      // address never sees the kernels of a destroyed one
+      thread_local std::unordered_map<std::uint64_t, std::shared_ptr<ThreadKernels>> threadKernels;
+
+      auto & slot = threadKernels[mId];
+      if (!slot) {
+        for (auto entry = threadKernels.begin(); entry != threadKernels.end();) {
+          if (entry->second && !entry->second->alive) {
+            entry = threadKernels.erase(entry);
+          } else {
+            ++entry;
+          }
+        }
+
+        slot = std::make_shared<ThreadKernels>();
+        std::lock_guard<std::mutex> lock(mThreadKernelsMutex);
+        mThreadKernels.erase(std::remove_if(mThreadKernels.begin(),
+                                            mThreadKernels.end(),
+                                            [](const std::weak_ptr<ThreadKernels> & registered) {
+                                              return registered.expired();
+                                            }),
+                             mThreadKernels.end());
+        mThreadKernels.push_back(slot);
+      }
+      auto & cache = *slot;
+
+      auto epoch = mProgramEpoch.load();
+      if (cache.epoch != epoch) {
+        cache.kernels.clear();
+        cache.epoch = epoch;
+      }
+
+      auto key = program + '\0' + kernelName;
+      auto kernel = cache.kernels.find(key);
+      if (kernel != cache.kernels.end()) {
+        return kernel->second;
+      }
+
+      ::cl::Program builtProgram;
+      if (!findProgram(program, builtProgram)) {
+        throw mfl::Exception::build("No program named {} has been loaded yet",
+                                    program);
+      }
+
+      try {
+        return cache.kernels.emplace(key,
+                                     ::cl::Kernel(builtProgram,
+                                                  kernelName.c_str())).first->second;
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    std::vector<::cl::CommandQueue> Runner::commandQueues(std::size_t deviceCount) {
+      if (deviceCount <= 0) {
+        return std::vector<::cl::CommandQueue>(0);
+      }
+
+      discover();
+
+      std::lock_guard<std::mutex> lock(mCommandsMutex);
+      if (mCommands.size() < deviceCount) {
+        mCommands.reserve(deviceCount);
+
+        try {
+          for (size_t i = mCommands.size(); i < deviceCount; ++i) {
+            mCommands.emplace_back(mContext, mDevices[i], mQueueProperties);
+          }
+        } catch (::cl::Error & err) {
+          throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                      err.what(),
+                                      err.err(),
+                                      getErrorString(err.err()));
+        }
+
+        if (mCommands.size() < deviceCount) {
+          throw mfl::Exception::build("Could not create command queues");
+        }
+      }
+
+      return std::vector<::cl::CommandQueue>(mCommands.cbegin(),
+                                             mCommands.cbegin() + deviceCount);
+    }
+
+    void Runner::releaseQueues() {
+      std::lock_guard<std::mutex> lock(mCommandsMutex);
+      mCommands = std::vector<::cl::CommandQueue>(0);
+      mTrackedQueues.clear();
+    }
+
+    void Runner::enableProfiling() {
+      if (mProfiler) {
+        return;
+      }
+
+      mProfiler = std::make_shared<Profiler>();
+      mQueueProperties |= CL_QUEUE_PROFILING_ENABLE;
+      releaseQueues();
+    }
+
+    void Runner::enableAutotuning(const std::string & path) {
+      mTuningTable.reset(new TuningTable(path));
+    }
+
+    std::string Runner::tuningKey(const std::string & program,
+                                  const std::string & kernelName,
+                                  std::size_t device,
+                                  std::size_t global) const {
+      // Sub-devices keep their parent's name, so the compute units tell a
+      // partition from the whole device
+      return program
+          + '\t' + kernelName
+          + '\t' + mDeviceInfo[device].name
+          + '/' + std::to_string(mDeviceInfo[device].computeUnits)
+          + '\t' + std::to_string(global);
+    }
+
+    ::cl::NDRange Runner::tunedLocal(const ::cl::CommandQueue & queue,
+                                     const ::cl::Kernel & kernel,
+                                     const ::cl::NDRange & global) const {
+      if (global.dimensions() != 1) {
+        return ::cl::NullRange;
+      }
+
+      // Kernels of specialized or foreign programs were never tuned
+      cl_program handle;
+      clGetKernelInfo(kernel(), CL_KERNEL_PROGRAM, sizeof(handle), &handle, nullptr);
+
+      std::string program;
+      {
+        std::lock_guard<std::mutex> lock(mProgramNamesMutex);
+        auto name = mProgramNames.find(handle);
+        if (name == mProgramNames.end()) {
+          return ::cl::NullRange;
+        }
+        program = name->second;
+      }
+
+      auto queueDevice = queue.getInfo<CL_QUEUE_DEVICE>();
+      for (std::size_t device = 0; device < mDevices.size(); ++device) {
+        if (mDevices[device]() != queueDevice()) {
+          continue;
+        }
+
+        std::size_t local;
+        if (mTuningTable->lookup(tuningKey(program,
+                                           kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(),
+                                           device,
+                                           global[0]),
+                                 mDeviceInfo[device].driver,
+                                 local)
+            && local > 0) {
+          return ::cl::NDRange(local);
+        }
+        break;
+      }
+      return ::cl::NullRange;
+    }
+
+    std::size_t Runner::tune(const std::string & program,
+                             const std::string & kernelName,
+                             std::size_t device,
+                             std::size_t global,
+                             const std::function<void(::cl::Kernel &)> & setArguments,
+                             std::size_t localBytesPerItem,
+                             bool force) {
+      TraceScope trace("tune", kernelName.c_str());
+      discover();
+
+      if (!mTuningTable) {
+        throw mfl::Exception::build("Autotuning has not been enabled");
+      }
+
+      if (device >= mDevices.size()) {
+        throw mfl::Exception::build("No device with index {}", device);
+      }
+
+      auto key = tuningKey(program, kernelName, device, global);
+      auto driver = mDeviceInfo[device].driver;
+
+      std::size_t best = 0;
+      if (!force && mTuningTable->lookup(key, driver, best)) {
+        return best;
+      }
+
+      auto kernel = makeKernel(program, kernelName);
+      setArguments(kernel);
+
+      try {
+        auto & target = mDevices[device];
+        std::size_t multiple =
+            kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(target);
+        std::size_t limit = std::min<std::size_t>(
+            kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(target),
+            mDeviceInfo[device].maxWorkGroupSize);
+
+        if (localBytesPerItem > 0) {
+          std::size_t localMemory = mDeviceInfo[device].localMemory;
+          std::size_t kernelMemory = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(target);
+          limit = std::min(limit,
+                           localMemory > kernelMemory
+                           ? (localMemory - kernelMemory) / localBytesPerItem
+                           : 0);
+        }
+
+        // Zero stands for the driver's own choice and is the baseline
+        std::vector<std::size_t> candidates(1, 0);
+        for (std::size_t local = std::max<std::size_t>(multiple, 1); local <= limit; local *= 2) {
+          if (global % local == 0) {
+            candidates.push_back(local);
+          }
+        }
+
+        ::cl::CommandQueue queue(mContext, target, CL_QUEUE_PROFILING_ENABLE);
+        const std::size_t repetitions = 5;
+        cl_ulong bestTime = 0;
+
+        for (auto local : candidates) {
+          std::vector<cl_ulong> times;
+          try {
+            for (std::size_t i = 0; i <= repetitions; ++i) {
+              ::cl::Event event;
+              queue.enqueueNDRangeKernel(kernel,
+                                         ::cl::NullRange,
+                                         ::cl::NDRange(global),
+                                         local > 0 ? ::cl::NDRange(local) : ::cl::NullRange,
+                                         nullptr,
+                                         &event);
+              event.wait();
+
+              // The first run only warms up
+              if (i > 0) {
+                times.push_back(event.getProfilingInfo<CL_PROFILING_COMMAND_END>()
+                                    - event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+              }
+            }
+          } catch (::cl::Error & err) {
+            if (err.err() == CL_INVALID_WORK_GROUP_SIZE || err.err() == CL_OUT_OF_RESOURCES) {
+              continue;
+            }
+            throw;
+          }
+
+          std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+          auto median = times[times.size() / 2];
+          if (bestTime == 0 || median < bestTime) {
+            bestTime = median;
+            best = local;
+          }
+        }
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+
+      mTuningTable->store(key, driver, best);
+      return best;
+    }
+
+    ::cl::Event Runner::launch(const ::cl::CommandQueue & queue,
+                               const ::cl::Kernel & kernel,
+                               const ::cl::NDRange & global,
+                               const ::cl::NDRange & local,
+                               const ::cl::NDRange & offset,
+                               const std::vector<::cl::Event> * events) {
+      TraceScope trace("launch", "enqueueNDRangeKernel");
+
+      ::cl::Event event;
+      try {
+        auto start = std::chrono::steady_clock::now();
+        queue.enqueueNDRangeKernel(kernel,
+                                   offset,
+                                   global,
+                                   mTuningTable && local.dimensions() == 0
+                                   ? tunedLocal(queue, kernel, global)
+                                   : local,
+                                   events,
+                                   &event);
+
+        if (mProfiler) {
+          auto enqueue = std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start).count();
+          mProfiler->record(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), event, enqueue);
+        }
+
+        // Queues passed in by the caller may profile without the Profiler
+        if (Trace::enabled()
+            && (queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE)) {
+          Trace::recordDevice(queue, event, kernel.getInfo<CL_KERNEL_FUNCTION_NAME>());
+        }
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+      return event;
+    }
+
+    void CL_CALLBACK Runner::completed(cl_event, cl_int status, void * data) {
+      std::unique_ptr<Promise<void>> promise(static_cast<Promise<void> *>(data));
+      if (status < 0) {
+        promise->setException(std::make_exception_ptr(
+            mfl::Exception::build("OpenCL error: command failed ({} : {})",
+                                  status,
+                                  getErrorString(status))));
+      } else {
+        promise->setValue();
+      }
+    }
+
+    void CL_CALLBACK Runner::released(cl_event, cl_int, void * data) {
+      delete static_cast<std::shared_ptr<void> *>(data);
+    }
+
+    void Runner::holdUntil(const ::cl::Event & event, const std::shared_ptr<void> & hold) const {
+      std::unique_ptr<std::shared_ptr<void>> held(new std::shared_ptr<void>(hold));
+      ::cl::Event(event).setCallback(CL_COMPLETE, &Runner::released, held.get());
+      held.release();
+    }
+
+    Future<void> Runner::completion(const ::cl::Event & event) const {
+      auto promise = new Promise<void>();
+      auto future = promise->future();
+      try {
+        ::cl::Event(event).setCallback(CL_COMPLETE, &Runner::completed, promise);
+      } catch (::cl::Error & err) {
+        delete promise;
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+      return future;
+    }
+
+    Future<void> Runner::launchAsync(const ::cl::CommandQueue & queue,
+                                     const ::cl::Kernel & kernel,
+                                     const ::cl::NDRange & global,
+                                     const ::cl::NDRange & local,
+                                     const ::cl::NDRange & offset,
+                                     const std::vector<::cl::Event> * events) {
+      auto event = launch(queue, kernel, global, local, offset, events);
+      try {
+        queue.flush();
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+      return completion(event);
+    }
+
+    ::cl::CommandQueue Runner::trackedQueue(std::size_t device) {
+      discover();
+
+      if (device >= mDevices.size()) {
+        throw mfl::Exception::build("No device at index {}", device);
+      }
+
+      std::lock_guard<std::mutex> lock(mCommandsMutex);
+      if (mTrackedQueues.size() < mDevices.size()) {
+        mTrackedQueues.resize(mDevices.size());
+      }
+
+      auto & queues = mTrackedQueues[device];
+      if (queues.empty()) {
+        try {
+          if (mDeviceInfo[device].queueProperties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
+            queues.emplace_back(mContext,
+                                mDevices[device],
+                                mQueueProperties | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+          } else {
+            for (int i = 0; i < 4; ++i) {
+              queues.emplace_back(mContext, mDevices[device], mQueueProperties);
+            }
+          }
+        } catch (::cl::Error & err) {
+          throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                      err.what(),
+                                      err.err(),
+                                      getErrorString(err.err()));
+        }
+      }
+
+      return queues[mTrackedNext++ % queues.size()];
+    }
+
+    ::cl::Event Runner::submit(const ::cl::Kernel & kernel,
+                               const std::vector<std::string> & reads,
+                               const std::vector<std::string> & writes,
+                               const ::cl::NDRange & global,
+                               const ::cl::NDRange & local,
+                               std::size_t device) {
+      if (device == ANY_DEVICE) {
+        device = preferredDevice(reads.empty() ? writes : reads);
+      }
+      auto queue = trackedQueue(device);
+
+      std::vector<std::string> used(reads);
+      used.insert(used.end(), writes.begin(), writes.end());
+      auto hold = holdBuffers(used);
+      try {
+        return mTracker.track(reads,
+                              writes,
+                              [&](const std::vector<::cl::Event> & wait) {
+                                auto moved = migrate(queue,
+                                                     device,
+                                                     used,
+                                                     wait.empty() ? nullptr : &wait);
+                                // The moves already waited for the rest
+                                auto & after = moved.empty() ? wait : moved;
+                                auto event = launch(queue,
+                                                    kernel,
+                                                    global,
+                                                    local,
+                                                    ::cl::NullRange,
+                                                    after.empty() ? nullptr : &after);
+                                holdUntil(event, hold);
+                                queue.flush();
+                                return event;
+                              });
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    void Runner::synchronize() {
+      TraceScope trace("queue", "synchronize");
+
+      std::vector<::cl::CommandQueue> queues;
+      {
+        std::lock_guard<std::mutex> lock(mCommandsMutex);
+        for (auto & deviceQueues : mTrackedQueues) {
+          queues.insert(queues.end(), deviceQueues.begin(), deviceQueues.end());
+        }
+      }
+
+      try {
+        for (auto & queue : queues) {
+          queue.finish();
+        }
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    DispatchStatistics Runner::dispatch(const ::cl::Kernel & kernel,
+                                        const std::vector<DispatchOutput> & outputs,
+                                        std::size_t global,
+                                        std::size_t local,
+                                        std::size_t offset,
+                                        const std::vector<::cl::Event> * events) {
+      TraceScope trace("launch", "dispatch");
+      discover();
+
+      if (local > 0 && global % local != 0) {
+        throw mfl::Exception::build("Global size {} is not a multiple of local size {}",
+                                    global,
+                                    local);
+      }
+
+      std::size_t alignment = 1;
+      for (auto & info : mDeviceInfo) {
+        alignment = std::max(alignment, info.alignment);
+      }
+
+      // Chunks start where every output's sub-buffer origin is aligned
+      auto granularity = std::max<std::size_t>(local, 1);
+      std::vector<std::string> names;
+      for (auto & output : outputs) {
+        names.push_back(output.buffer);
+      }
+      auto hold = holdBuffers(names);
+      std::vector<::cl::Buffer> parents;
+      for (auto & output : outputs) {
+        if (output.bytesPerItem == 0
+            || (offset * output.bytesPerItem) % alignment != 0) {
+          throw mfl::Exception::build("Dispatch offset {} does not align output {}",
+                                      offset,
+                                      output.buffer);
+        }
+        auto step = alignment / greatestCommonDivisor(alignment, output.bytesPerItem);
+        granularity = granularity / greatestCommonDivisor(granularity, step) * step;
+        parents.push_back(getBuffer(output.buffer));
+      }
+
+      auto queues = commandQueues(mDevices.size());
+      auto minimumChunk = std::max(granularity,
+                                   global / (queues.size() * 64) / granularity * granularity);
+
+      std::string name;
+      try {
+        name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+
+      // Measured items per second, zero until a device has run a chunk
+      std::vector<double> throughput(queues.size(), 0.0);
+      std::vector<double> estimate;
+      for (auto & info : mDeviceInfo) {
+        estimate.push_back(estimatedThroughput(info));
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mThroughputMutex);
+        auto known = mThroughput.find(name);
+        if (known != mThroughput.end() && known->second.size() == throughput.size()) {
+          throughput = known->second;
+        }
+      }
+
+      // Unmeasured devices are scaled from a measured one by their hardware estimate
+      auto rate = [&](std::size_t device) {
+        if (throughput[device] > 0) {
+          return throughput[device];
+        }
+        for (std::size_t other = 0; other < throughput.size(); ++other) {
+          if (throughput[other] > 0 && estimate[other] > 0) {
+            return estimate[device] * throughput[other] / estimate[other];
+          }
+        }
+        return estimate[device];
+      };
+
+      DispatchStatistics statistics;
+      statistics.items.assign(queues.size(), 0);
+      statistics.chunks.assign(queues.size(), 0);
+
+      struct Chunk {
+        ::cl::Event event;
+        std::size_t size;
+        std::chrono::steady_clock::time_point enqueued;
+      };
+
+      std::mutex mutex;
+      // Arguments are captured at enqueue, so binding and enqueueing
+      // together lets every chunk share the kernel
+      std::mutex enqueueMutex;
+      ::cl::Kernel bound(kernel);
+      std::size_t next = 0;
+      std::vector<std::deque<Chunk>> running(queues.size());
+      std::vector<std::exception_ptr> failures(queues.size());
+
+      auto worker = [&](std::size_t device) {
+        auto & chunks = running[device];
+        auto idle = std::chrono::steady_clock::now();
+
+        // Times the oldest chunk from when the device could first start it
+        auto retire = [&]() {
+          auto chunk = std::move(chunks.front());
+          chunks.pop_front();
+          chunk.event.wait();
+          auto now = std::chrono::steady_clock::now();
+          auto elapsed = std::chrono::duration<double>(
+              now - std::max(chunk.enqueued, idle)).count();
+          idle = now;
+
+          std::lock_guard<std::mutex> lock(mutex);
+          if (elapsed > 0) {
+            auto measured = chunk.size / elapsed;
+            throughput[device] = throughput[device] > 0
+                                 ? 0.5 * throughput[device] + 0.5 * measured
+                                 : measured;
+          }
+        };
+
+        try {
+          while (true) {
+            std::size_t begin;
+            std::size_t size;
+            bool first;
+            {
+              std::lock_guard<std::mutex> lock(mutex);
+              if (next >= global) {
+                break;
+              }
+
+              double total = 0;
+              for (std::size_t other = 0; other < throughput.size(); ++other) {
+                total += rate(other);
+              }
+              double share = total > 0 ? rate(device) / total : 1.0 / queues.size();
+              size = static_cast<std::size_t>((global - next) * share / 2);
+              size = (size + granularity - 1) / granularity * granularity;
+              size = std::min(std::max(size, minimumChunk), global - next);
+              begin = next;
+              next += size;
+              first = statistics.chunks[device] == 0;
+              statistics.items[device] += size;
+              statistics.chunks[device]++;
+            }
+
+            Chunk chunk{::cl::Event(), size, std::chrono::steady_clock::now()};
+            {
+              std::lock_guard<std::mutex> lock(enqueueMutex);
+              for (std::size_t i = 0; i < outputs.size(); ++i) {
+                cl_buffer_region region{(offset + begin) * outputs[i].bytesPerItem,
+                                        size * outputs[i].bytesPerItem};
+                bound.setArg(outputs[i].argument,
+                             parents[i].createSubBuffer(0,
+                                                        CL_BUFFER_CREATE_TYPE_REGION,
+                                                        &region));
+              }
+              queues[device].enqueueNDRangeKernel(bound,
+                                                  ::cl::NDRange(offset + begin),
+                                                  ::cl::NDRange(size),
+                                                  local > 0 ? ::cl::NDRange(local) : ::cl::NullRange,
+                                                  first ? events : nullptr,
+                                                  &chunk.event);
+            }
+            queues[device].flush();
+            chunks.push_back(std::move(chunk));
+
+            // The next chunk is queued before the previous one is waited on,
+            // so the device never idles on the host
+            if (chunks.size() > 1) {
+              retire();
+            }
+          }
+        } catch (...) {
+          failures[device] = std::current_exception();
+          std::lock_guard<std::mutex> lock(mutex);
+          next = global;
+        }
+      };
+
+      std::vector<std::thread> threads;
+      threads.reserve(queues.size());
+      for (std::size_t device = 1; device < queues.size(); ++device) {
+        threads.emplace_back(worker, device);
+      }
+      worker(0);
+      for (auto & thread : threads) {
+        thread.join();
+      }
+
+      for (auto & failure : failures) {
+        if (failure) {
+          try {
+            std::rethrow_exception(failure);
+          } catch (::cl::Error & err) {
+            throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                        err.what(),
+                                        err.err(),
+                                        getErrorString(err.err()));
+          }
+        }
+      }
+
+      // Queues are in order, so each device's last chunk covers its others
+      for (auto & chunks : running) {
+        if (!chunks.empty()) {
+          statistics.events.push_back(chunks.back().event);
+          holdUntil(chunks.back().event, hold);
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mThroughputMutex);
+        mThroughput[name] = throughput;
+      }
+
+      return statistics;
+    }
+
+    CommandGraph Runner::recordGraph() {
+      return CommandGraph([this](const std::string & name) {
+        auto hold = holdBuffers({name});
+        return ResolvedBuffer{getBuffer(name), hold};
+      });
+    }
+
+    Stream Runner::makeStream(const StreamOptions & options) const {
+      discover();
+
+      if (options.device >= mDevices.size()) {
+        throw mfl::Exception::build("No device with index {}", options.device);
+      }
+
+      auto depth = std::max<std::size_t>(options.depth, 1);
+      auto tileBytes = options.tileBytes;
+      if (tileBytes == 0) {
+        tileBytes = std::min<std::size_t>({mBufferMemory,
+                                           mTotalMemory / (depth * 4),
+                                           64 * 1024 * 1024});
+      }
+      auto outputBytes = options.outputBytes > 0 ? options.outputBytes : tileBytes;
+
+      if (tileBytes > mBufferMemory || outputBytes > mBufferMemory) {
+        throw mfl::Exception::build("Stream tiles of {}B exceed the allocation limit of {}B",
+                                    std::max(tileBytes, outputBytes),
+                                    mBufferMemory);
+      }
+
+      try {
+        return Stream(mContext,
+                      mDevices[options.device],
+                      mQueueProperties,
+                      tileBytes,
+                      outputBytes,
+                      depth);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    void Runner::stream(const void * input,
+                        std::size_t size,
+                        const StreamKernel & kernel,
+                        const StreamMerge & merge,
+                        const StreamOptions & options) {
+      auto stream = makeStream(options);
+      auto data = static_cast<const char *>(input);
+
+      try {
+        stream.run(size,
+                   [data](std::size_t offset, std::size_t, std::vector<char> &) {
+                     return data + offset;
+                   },
+                   kernel,
+                   merge);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    void Runner::streamFile(const std::string & path,
+                            const StreamKernel & kernel,
+                            const StreamMerge & merge,
+                            const StreamOptions & options) {
+      std::ifstream file(path, std::ios::binary | std::ios::ate);
+      if (!file) {
+        throw mfl::Exception::build("Could not open {}", path);
+      }
+      std::size_t size = file.tellg();
+
+      auto stream = makeStream(options);
+
+      try {
+        stream.run(size,
+                   [&file, &path](std::size_t offset,
+                                  std::size_t bytes,
+                                  std::vector<char> & staging) {
+                     staging.resize(bytes);
+                     file.seekg(offset);
+                     if (!file.read(staging.data(), bytes)) {
+                       throw mfl::Exception::build("Could not read {}", path);
+                     }
+                     return static_cast<const char *>(staging.data());
+                   },
+                   kernel,
+                   merge);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    ::cl::Kernel Runner::makeKernel(const std::string & program,
+                                    const std::string & kernelName,
+                                    bool verbose) {
+      TraceScope trace("kernel", kernelName.c_str());
+
+      ::cl::Program builtProgram;
+      if (!findProgram(program, builtProgram)) {
+        throw mfl::Exception::build("No program named {} has been loaded yet",
+                                    program);
+      }
+
+      ::cl::Kernel kernel(builtProgram, kernelName.c_str());
+
+      if (verbose) {
+        for (auto device : mDevices) {
+          mfl::out::println("Kernel info for {}", device.getInfo<CL_DEVICE_NAME>());
+          auto compileWorkGroupSize =
+              kernel.getWorkGroupInfo<CL_KERNEL_COMPILE_WORK_GROUP_SIZE>(device);
+          mfl::out::println(" * Compile work group size:        {}, {}, {}",
+                            compileWorkGroupSize[0],
+                            compileWorkGroupSize[1],
+                            compileWorkGroupSize[2]);
+          size_t globalSize[3];
+          clGetKernelWorkGroupInfo(kernel(),
+                                   device(),
+                                   CL_KERNEL_GLOBAL_WORK_SIZE,
+                                   sizeof(globalSize),
+                                   globalSize,
+                                   0);
+          mfl::out::println(" * Global work size:               {}, {}, {}",
+                            globalSize[0],
+                            globalSize[1],
+                            globalSize[2]);
+          mfl::out::println(" * Local memory size:              {}B",
+                            kernel.getWorkGroupInfo
+                                <CL_KERNEL_LOCAL_MEM_SIZE>(device));
+          mfl::out::println(" * Preferred group size multiple:  {}",
+                            kernel.getWorkGroupInfo
+                                <CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device));
+          mfl::out::println(" * Private memory size:            {}B",
+                            kernel.getWorkGroupInfo
+                                <CL_KERNEL_PRIVATE_MEM_SIZE>(device));
+          mfl::out::println(" * Work group size:                {}",
+                            kernel.getWorkGroupInfo
+                                <CL_KERNEL_WORK_GROUP_SIZE>(device));
+          mfl::out::println();
+        }
+      }
+
+      return kernel;
+    }
+
+    void Runner::enableStaging(std::size_t slots, std::size_t slotBytes) {
+      discover();
+
+      if (!mStaging.empty()) {
+        return;
+      }
+
+      if (slotBytes == 0) {
+        slotBytes = std::min<std::size_t>(std::max<std::size_t>(mBufferMemory / 256, 256 * 1024),
+                                          16 * 1024 * 1024);
+      }
+
+      try {
+        std::vector<std::unique_ptr<StagingRing>> rings;
+        for (auto & device : mDevices) {
+          rings.emplace_back(new StagingRing(mContext, device, slotBytes, slots));
+        }
+        mStaging = std::move(rings);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    StagingRing * Runner::stagingRing(const ::cl::CommandQueue & queue) const {
+      if (mStaging.empty()) {
+        return nullptr;
+      }
+      auto device = deviceIndex(queue);
+      return mStaging[device < 0 ? 0 : device].get();
+    }
+
+    ::cl::Event Runner::upload(const ::cl::CommandQueue & queue,
+                               const std::string & name,
+                               const void * data,
+                               std::size_t size,
+                               std::size_t offset,
+                               const std::vector<::cl::Event> * events) {
+      TraceScope trace("transfer", name.c_str());
+
+      auto hold = holdBuffers({name});
+      auto buffer = getBuffer(name);
+      try {
+        place(name, deviceIndex(queue));
+        if (auto staging = stagingRing(queue)) {
+          auto event = staging->upload(queue, buffer, data, size, offset, events);
+          if (event()) {
+            holdUntil(event, hold);
+          }
+          return event;
+        }
+
+        ::cl::Event event;
+        queue.enqueueWriteBuffer(buffer, CL_TRUE, offset, size, data, events, &event);
+        return event;
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    void Runner::download(const ::cl::CommandQueue & queue,
+                          const std::string & name,
+                          void * data,
+                          std::size_t size,
+                          std::size_t offset,
+                          const std::vector<::cl::Event> * events) {
+      TraceScope trace("transfer", name.c_str());
+
+      auto buffer = getBuffer(name);
+      try {
+        if (auto staging = stagingRing(queue)) {
+          staging->download(queue, buffer, data, size, offset, events);
+        } else {
+          queue.enqueueReadBuffer(buffer, CL_TRUE, offset, size, data, events);
+        }
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    std::size_t Runner::partition(const DevicePartition & partition) {
+      TraceScope trace("device", "partition");
+      discover();
+
+      bool programs = mPrograms.any([](const std::string &, const ::cl::Program &) {
+        return true;
+      });
+      {
+        std::lock_guard<std::mutex> lock(mDeferredMutex);
+        programs = programs || !mDeferredPrograms.empty();
+      }
+      bool buffers = mBuffers.any([](const std::string &, const BufferEntry &) {
+        return true;
+      });
+      if (programs || buffers) {
+        throw mfl::Exception::build("Devices must be partitioned before any program"
+                                        " or buffer is created");
+      }
+
+      try {
+        auto devices = partitionDevices(mDeviceInfo, partition);
+        if (devices.size() == mDeviceInfo.size()) {
+          return mDevices.size();
+        }
+
+        mDeviceInfo = std::move(devices);
+        mDevices.clear();
+        for (auto & info : mDeviceInfo) {
+          mDevices.push_back(info.device);
+        }
+
+        releaseQueues();
+        mTransferQueue = ::cl::CommandQueue();
+        mContext = ::cl::Context(mDevices);
+        {
+          std::lock_guard<std::mutex> lock(mModulesMutex);
+          mModules.clear();
+        }
+        mBufferPool.reset();
+        mStaging.clear();
+        {
+          std::lock_guard<std::mutex> lock(mThroughputMutex);
+          mThroughput.clear();
+        }
+
+        // Specializations and kernels built for the whole devices are gone
+        // with the old context
+        mSpecializations.clear();
+        mProgramEpoch++;
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+      return mDevices.size();
+    }
+
+    ::cl::Buffer Runner::createBufferOn(const std::string & name,
+                                        std::size_t device,
+                                        cl_mem_flags flags,
+                                        std::size_t size) {
+      TraceScope trace("buffer", name.c_str());
+      discover();
+
+      if (device >= mDevices.size()) {
+        throw mfl::Exception::build("No device at index {}", device);
+      }
+
+      auto buffer = createBuffer(name, flags, size);
+      try {
+        auto queue = commandQueues(device + 1)[device];
+        // The fill is the first touch, made by the device's own threads
+        std::vector<::cl::Memory> objects(1, buffer);
+        queue.enqueueMigrateMemObjects(objects, CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED);
+        queue.enqueueFillBuffer(buffer, cl_uchar(0), 0, size);
+        queue.finish();
+        place(name, static_cast<int>(device));
+      } catch (::cl::Error & err) {
+        releaseBuffer(name);
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+      return buffer;
+    }
+
+    ::cl::Buffer Runner::createPooledBuffer(const std::string & name,
+                                            cl_mem_flags flags,
+                                            std::size_t size) {
+      TraceScope trace("buffer", name.c_str());
+
+      if (!mBufferPool) {
+        return createBuffer(name, flags, size);
+      }
+
+      if (mBuffers.contains(name)) {
+        throw mfl::Exception::build("Trying to create a buffer with an"
+                                        "existing name");
+      }
+
+      try {
+        BufferPool::Block block;
+        auto buffer = mBufferPool->allocate(flags, size, block);
+        return registerBuffer(name, std::move(buffer), false, &block);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    void Runner::enableBufferPool(std::size_t slabSize) {
+      discover();
+
+      if (mBufferPool) {
+        return;
+      }
+
+      std::size_t alignment = 0;
+      for (auto & info : mDeviceInfo) {
+        alignment = std::max(alignment, info.alignment);
+      }
+
+      mBufferPool.reset(new BufferPool(mContext,
+                                       alignment,
+                                       std::min(slabSize, mBufferMemory)));
+    }
+
+    ::cl::Buffer Runner::createHostBuffer(const std::string & name,
+                                          cl_mem_flags flags,
+                                          std::size_t size) {
+      TraceScope trace("buffer", name.c_str());
+      discover();
+
+      if (!mZeroCopy) {
+        return createBuffer(name, flags | CL_MEM_ALLOC_HOST_PTR, size);
+      }
+
+      if (mBuffers.contains(name)) {
+        throw mfl::Exception::build("Trying to create a buffer with an"
+                                        "existing name");
+      }
+
+      std::size_t alignment = 1;
+      for (auto & info : mDeviceInfo) {
+        alignment = std::max(alignment, info.alignment);
+      }
+
+      std::unique_ptr<char[]> storage(new char[size + alignment]);
+      auto address = reinterpret_cast<std::uintptr_t>(storage.get());
+      auto aligned = reinterpret_cast<void *>((address + alignment - 1) / alignment * alignment);
+
+      try {
+        ::cl::Buffer buffer(mContext, flags | CL_MEM_USE_HOST_PTR, size, aligned);
+        // Commands still in flight may use the memory after the entry is gone
+        buffer.setDestructorCallback(&freeHostMemory, storage.get());
+        storage.release();
+        return registerBuffer(name, std::move(buffer), false);
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    ::cl::Buffer Runner::registerBuffer(const std::string & name,
+                                        ::cl::Buffer && buffer,
+                                        bool evictable,
+                                        const BufferPool::Block * block) {
+      std::size_t size = buffer.getInfo<CL_MEM_SIZE>();
+      cl_mem_flags flags = buffer.getInfo<CL_MEM_FLAGS>();
+
+      // Concurrent creations may overshoot the budget until the next spill
+      if (mResident + size > mBudget) {
+        std::lock_guard<std::mutex> residencyLock(mResidencyMutex);
+        spill(size);
+      }
+
+      auto & shard = mBuffers.shard(name);
+      std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+
+      // Another thread may have registered the name in the meantime
+      if (shard.entries.find(name) != shard.entries.end()) {
+        if (block) {
+          mBufferPool->release(*block);
+        }
+        throw mfl::Exception::build("Trying to create a buffer with an"
+                                        "existing name");
+      }
+
+      auto & entry = shard.entries[name];
+      entry.buffer = std::move(buffer);
+      entry.size = size;
+      entry.flags = flags;
+      entry.evictable = evictable
+          && !(flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR));
+      entry.resident = true;
+      entry.pins = 0;
+      entry.holds = std::make_shared<std::atomic<std::size_t>>(0);
+      entry.lastUse = std::chrono::steady_clock::now().time_since_epoch().count();
+      entry.pooled = block != nullptr;
+      if (block) {
+        entry.block = *block;
+      }
+      entry.device = -1;
+      entry.migrations = 0;
+      entry.migratedBytes = 0;
+      mResident += size;
+      return entry.buffer;
+    }
+
+    bool Runner::spill(std::size_t bytes) const {
+      TraceScope trace("residency", "spill");
+
+      bool spilled = false;
+      bool finished = false;
+
+      while (bytes == SIZE_MAX || mResident + bytes > mBudget) {
+        std::string victim;
+        std::uint64_t oldest = 0;
+        for (auto & shard : mBuffers.shards()) {
+          std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+          for (auto & candidate : shard.entries) {
+            auto & entry = candidate.second;
+            if (entry.evictable
+                && entry.resident
+                && entry.pins == 0
+                && *entry.holds == 0
+                && (victim.empty() || entry.lastUse < oldest)) {
+              victim = candidate.first;
+              oldest = entry.lastUse;
+            }
+          }
+        }
+
+        if (victim.empty()) {
+          break;
+        }
+
+        auto & shard = mBuffers.shard(victim);
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+        auto found = shard.entries.find(victim);
+
+        // Released or pinned since it was picked
+        if (found == shard.entries.end()
+            || found->second.pins > 0
+            || *found->second.holds > 0) {
+          continue;
+        }
+        auto & entry = found->second;
+
+        // Commands on any queue may still be writing the victim
+        if (!finished) {
+          std::lock_guard<std::mutex> commandsLock(mCommandsMutex);
+          for (auto & queue : mCommands) {
+            queue.finish();
+          }
+          for (auto & queues : mTrackedQueues) {
+            for (auto & queue : queues) {
+              queue.finish();
+            }
+          }
+          finished = true;
+        }
+
+        entry.spilled.resize(entry.size);
+        transferQueue().enqueueReadBuffer(entry.buffer,
+                                          CL_TRUE,
+                                          0,
+                                          entry.size,
+                                          entry.spilled.data());
+        entry.buffer = ::cl::Buffer();
+        entry.resident = false;
+        mResident -= entry.size;
+        mSpilled += entry.size;
+        mEvictions++;
+        spilled = true;
+      }
+      return spilled;
+    }
+
+    bool Runner::spillAll() {
+      std::lock_guard<std::mutex> lock(mResidencyMutex);
+      return spill(SIZE_MAX);
+    }
+
+    ::cl::Buffer Runner::restore(const std::string & name) const {
+      TraceScope trace("residency", name.c_str());
+
+      std::lock_guard<std::mutex> residencyLock(mResidencyMutex);
+      auto & shard = mBuffers.shard(name);
+
+      std::size_t size;
+      {
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+        auto entry = shard.entries.find(name);
+        if (entry == shard.entries.end()) {
+          throw mfl::Exception::build("No buffer named {}", name);
+        }
+        if (entry->second.resident) {
+          return entry->second.buffer;
+        }
+        size = entry->second.size;
+      }
+
+      try {
+        spill(size);
+
+        // Released while making room
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+        auto found = shard.entries.find(name);
+        if (found == shard.entries.end()) {
+          throw mfl::Exception::build("No buffer named {}", name);
+        }
+        auto & entry = found->second;
+        entry.buffer = ::cl::Buffer(mContext,
+                                    entry.flags & ~CL_MEM_COPY_HOST_PTR,
+                                    entry.size);
+        transferQueue().enqueueWriteBuffer(entry.buffer,
+                                           CL_TRUE,
+                                           0,
+                                           entry.size,
+                                           entry.spilled.data());
+
+        std::vector<char>().swap(entry.spilled);
+        entry.resident = true;
+        entry.device = 0;
+        mResident += entry.size;
+        mSpilled -= entry.size;
+        mRestores++;
+        return entry.buffer;
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    const ::cl::CommandQueue & Runner::transferQueue() const {
+      if (!mTransferQueue()) {
+        mTransferQueue = ::cl::CommandQueue(mContext, mDevices[0]);
+      }
+      return mTransferQueue;
+    }
+
+    void Runner::setMemoryBudget(std::size_t bytes) {
+      discover();
+
+      std::lock_guard<std::mutex> lock(mResidencyMutex);
+      mBudget = bytes;
+      spill(0);
+    }
+
+    void Runner::pinBuffer(const std::string & name) const {
+      {
+        auto & shard = mBuffers.shard(name);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+        auto entry = shard.entries.find(name);
+        if (entry == shard.entries.end()) {
+          throw mfl::Exception::build("No buffer named {}", name);
+        }
+        entry->second.pins++;
+      }
+
+      // Pinned first, so it cannot be spilled again once restored
+      getBuffer(name);
+    }
+
+    void Runner::unpinBuffer(const std::string & name) const {
+      auto & shard = mBuffers.shard(name);
+      std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+      auto entry = shard.entries.find(name);
+      if (entry == shard.entries.end()) {
+        return;
+      }
+
+      auto pins = entry->second.pins.load();
+      while (pins > 0 && !entry->second.pins.compare_exchange_weak(pins, pins - 1)) {
+      }
+    }
+
+    std::shared_ptr<void> Runner::holdBuffers(const std::vector<std::string> & names) const {
+      // Counters rather than names, so a hold outliving its buffer, or the
+      // Runner, never touches another buffer of the same name
+      auto held = std::make_shared<std::vector<std::shared_ptr<std::atomic<std::size_t>>>>();
+      std::shared_ptr<void> hold(nullptr, [held](void *) {
+        for (auto & holds : *held) {
+          (*holds)--;
+        }
+      });
+
+      for (auto & name : names) {
+        {
+          auto & shard = mBuffers.shard(name);
+          std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+          auto entry = shard.entries.find(name);
+          if (entry == shard.entries.end()) {
+            throw mfl::Exception::build("No buffer named {}", name);
+          }
+          (*entry->second.holds)++;
+          held->push_back(entry->second.holds);
+        }
+
+        // Held first, so it cannot be spilled again once restored
+        getBuffer(name);
+      }
+      return hold;
+    }
+
+    ResidencyStatistics Runner::residency() const {
+      discover();
+
+      ResidencyStatistics statistics;
+      statistics.budget = mBudget;
+      statistics.resident = mResident;
+      statistics.spilled = mSpilled;
+      statistics.evictions = mEvictions;
+      statistics.restores = mRestores;
+      return statistics;
+    }
+
+    std::vector<BufferLocality> Runner::locality() const {
+      std::vector<BufferLocality> locality;
+      mBuffers.any([&locality](const std::string & name, const BufferEntry & entry) {
+        locality.push_back({name, entry.device, entry.migrations, entry.migratedBytes});
+        return false;
+      });
+      return locality;
+    }
+
+    std::size_t Runner::preferredDevice(const std::vector<std::string> & names) const {
+      discover();
+
+      std::vector<std::uint64_t> held(mDevices.size(), 0);
+      for (auto & name : names) {
+        auto & shard = mBuffers.shard(name);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+        auto entry = shard.entries.find(name);
+        if (entry == shard.entries.end()) {
+          continue;
+        }
+        int device = entry->second.device;
+        if (device >= 0 && static_cast<std::size_t>(device) < held.size()) {
+          held[device] += entry->second.size;
+        }
+      }
+
+      // Ties go to the better scored device
+      std::size_t preferred = 0;
+      for (std::size_t i = 1; i < held.size(); ++i) {
+        if (held[i] > held[preferred]) {
+          preferred = i;
+        }
+      }
+      return preferred;
+    }
+
+    ::cl::Event Runner::prefetch(const std::vector<std::string> & names,
+                                 std::size_t device,
+                                 const std::vector<::cl::Event> * events) {
+      TraceScope trace("transfer", "prefetch");
+      discover();
+
+      if (device >= mDevices.size()) {
+        throw mfl::Exception::build("No device at index {}", device);
+      }
+
+      try {
+        auto queue = commandQueues(device + 1)[device];
+        auto moved = migrate(queue, device, names, events);
+        if (moved.empty()) {
+          return ::cl::Event();
+        }
+        queue.flush();
+        return moved.back();
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+    }
+
+    int Runner::deviceIndex(const ::cl::CommandQueue & queue) const {
+      auto device = queue.getInfo<CL_QUEUE_DEVICE>();
+      for (std::size_t i = 0; i < mDevices.size(); ++i) {
+        if (mDevices[i]() == device()) {
+          return static_cast<int>(i);
+        }
+      }
+      return -1;
+    }
+
+    void Runner::place(const std::string & name, int device) const {
+      auto & shard = mBuffers.shard(name);
+      std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+      auto entry = shard.entries.find(name);
+      if (entry != shard.entries.end()) {
+        entry->second.device = device;
+      }
+    }
+
+    std::vector<::cl::Event> Runner::migrate(const ::cl::CommandQueue & queue,
+                                             std::size_t device,
+                                             const std::vector<std::string> & names,
+                                             const std::vector<::cl::Event> * events) {
+      std::vector<::cl::Memory> moving;
+      std::vector<std::string> movingNames;
+      auto target = static_cast<int>(device);
+
+      for (auto & name : names) {
+        ::cl::Buffer buffer = getBuffer(name);
+        auto & shard = mBuffers.shard(name);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+        if (shard.entries.at(name).device == target) {
+          continue;
+        }
+        moving.push_back(buffer);
+        movingNames.push_back(name);
+      }
+
+      std::vector<::cl::Event> moved;
+      if (moving.empty()) {
+        return moved;
+      }
+
+      try {
+        moved.emplace_back();
+        queue.enqueueMigrateMemObjects(moving, 0, events, &moved.back());
+      } catch (::cl::Error & err) {
+        throw mfl::Exception::build("OpenCL error: {} ({} : {})",
+                                    err.what(),
+                                    err.err(),
+                                    getErrorString(err.err()));
+      }
+
+      // Placed only once the move is queued, so a failed one leaves the
+      // buffers where they were
+      for (auto & name : movingNames) {
+        auto & shard = mBuffers.shard(name);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+        auto entry = shard.entries.find(name);
+        if (entry == shard.entries.end()) {
+          continue;
+        }
+
+        // Unplaced buffers are moved but not counted, having no known source
+        auto previous = entry->second.device.exchange(target);
+        if (previous >= 0 && previous != target) {
+          entry->second.migrations++;
+          entry->second.migratedBytes += entry->second.size;
+        }
+      }
+      return moved;
+    }
+
+    void Runner::releaseBuffer(const std::string & name) {
+      TraceScope trace("buffer", name.c_str());
+
+      auto events = mTracker.forget(name);
+
+      auto & shard = mBuffers.shard(name);
+      std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+
+      auto entry = shard.entries.find(name);
+      if (entry == shard.entries.end()) {
+        return;
+      }
+
+      if (entry->second.resident) {
+        mResident -= entry->second.size;
+      } else {
+        mSpilled -= entry->second.size;
+      }
+
+      // Held or tracked commands may still use the block. Failed ones are
+      // as finished as complete ones
+      if (entry->second.pooled) {
+        entry->second.buffer = ::cl::Buffer();
+        auto holds = entry->second.holds;
+        mBufferPool->release(entry->second.block, [holds, events]() {
+          if (*holds > 0) {
+            return false;
+          }
+          for (auto & event : events) {
+            try {
+              if (event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() > CL_COMPLETE) {
+                return false;
+              }
+            } catch (::cl::Error &) {
+            }
+          }
+          return true;
+        });
+      }
+      shard.entries.erase(entry);
     }
 
   }
@@ -0,0 +1,109 @@
+#include "include/mfl/cl/specialization.hpp"
+
+#include <algorithm>
+
+namespace mfl {
+  namespace cl {
+
+    namespace {
+      // Order independent, so the same values always map to one variant
+      std::string variantKey(const Program & base, std::vector<Define> defines) {
+        std::sort(defines.begin(),
+                  defines.end(),
+                  [](const Define & a, const Define & b) {
+                    return a.name < b.name;
+                  });
+
+        std::string key = base.name();
+        for (auto & define : defines) {
+          key += '|';
+          key += define.name;
+          key += '=';
+          key += define.value;
+        }
+        return key;
+      }
+    }
+
+    SpecializedProgram::SpecializedProgram(const Program & base,
+                                           const std::vector<Define> & defines) :
+        Program(buildString(base, defines)),
+        mBase(base),
+        mName(variantKey(base, defines)) {}
+
+    std::string SpecializedProgram::buildString(const Program & base,
+                                                const std::vector<Define> & defines) {
+      std::string options = base.buildString();
+      for (auto & define : defines) {
+        options += " -D ";
+        options += define.name;
+        options += '=';
+        options += define.value;
+      }
+      return options;
+    }
+
+    SpecializationCache::SpecializationCache(std::size_t limit) :
+        mLimit(limit),
+        mHits(0),
+        mMisses(0),
+        mEvictions(0) {}
+
+    ::cl::Program SpecializationCache::get(const Program & base,
+                                           const std::vector<Define> & defines,
+                                           const Build & build) {
+      SpecializedProgram variant(base, defines);
+      std::string key = variant.name();
+
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto entry = mEntries.find(key);
+        if (entry != mEntries.end()) {
+          mUses.splice(mUses.begin(), mUses, entry->second.use);
+          mHits++;
+          return entry->second.program;
+        }
+        mMisses++;
+      }
+
+      auto program = build(variant);
+
+      std::lock_guard<std::mutex> lock(mMutex);
+      auto entry = mEntries.find(key);
+      if (entry != mEntries.end()) {
+        mUses.splice(mUses.begin(), mUses, entry->second.use);
+        return entry->second.program;
+      }
+
+      mUses.push_front(key);
+      mEntries[key] = Entry{program, mUses.begin()};
+      evict();
+      return program;
+    }
+
+    void SpecializationCache::setLimit(std::size_t limit) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mLimit = limit;
+      evict();
+    }
+
+    void SpecializationCache::clear() {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mEntries.clear();
+      mUses.clear();
+    }
+
+    std::size_t SpecializationCache::size() const {
+      std::lock_guard<std::mutex> lock(mMutex);
+      return mEntries.size();
+    }
+
+    void SpecializationCache::evict() {
+      while (mEntries.size() > mLimit) {
+        mEntries.erase(mUses.back());
+        mUses.pop_back();
+        mEvictions++;
+      }
+    }
+  }
+}
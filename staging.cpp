@@ -0,0 +1,135 @@
+#include "include/mfl/cl/staging.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace mfl {
+  namespace cl {
+
+    StagingRing::StagingRing(const ::cl::Context & context,
+                             const ::cl::Device & device,
+                             std::size_t slotBytes,
+                             std::size_t slots) :
+        mSlotBytes(slotBytes),
+        mQueue(context, device),
+        mSlots(std::max<std::size_t>(slots, 1)),
+        mNext(0) {
+      for (auto & slot : mSlots) {
+        slot.buffer = ::cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, slotBytes);
+        slot.data = static_cast<char *>(mQueue.enqueueMapBuffer(slot.buffer,
+                                                                CL_TRUE,
+                                                                CL_MAP_READ | CL_MAP_WRITE,
+                                                                0,
+                                                                slotBytes));
+      }
+    }
+
+    StagingRing::~StagingRing() {
+      try {
+        for (auto & slot : mSlots) {
+          if (slot.event()) {
+            slot.event.wait();
+          }
+          mQueue.enqueueUnmapMemObject(slot.buffer, slot.data);
+        }
+        mQueue.finish();
+      } catch (...) {
+      }
+    }
+
+    StagingRing::Slot & StagingRing::acquire() {
+      auto & slot = mSlots[mNext];
+      mNext = (mNext + 1) % mSlots.size();
+
+      if (slot.event()) {
+        slot.event.wait();
+        slot.event = ::cl::Event();
+      }
+      return slot;
+    }
+
+    ::cl::Event StagingRing::upload(const ::cl::CommandQueue & queue,
+                                    const ::cl::Buffer & buffer,
+                                    const void * data,
+                                    std::size_t size,
+                                    std::size_t offset,
+                                    const std::vector<::cl::Event> * events) {
+      std::lock_guard<std::mutex> lock(mMutex);
+
+      // Every chunk waits on events, since out of order queues do not run
+      // the chunks after the first behind it
+      auto source = static_cast<const char *>(data);
+      std::vector<::cl::Event> chunks;
+      for (std::size_t done = 0; done < size; done += mSlotBytes) {
+        auto bytes = std::min(mSlotBytes, size - done);
+        auto & slot = acquire();
+        std::memcpy(slot.data, source + done, bytes);
+
+        ::cl::Event event;
+        queue.enqueueWriteBuffer(buffer,
+                                 CL_FALSE,
+                                 offset + done,
+                                 bytes,
+                                 slot.data,
+                                 events,
+                                 &event);
+        slot.event = event;
+        chunks.push_back(event);
+      }
+
+      ::cl::Event event;
+      if (chunks.size() == 1) {
+        event = chunks[0];
+      } else if (!chunks.empty()) {
+        queue.enqueueMarkerWithWaitList(&chunks, &event);
+      }
+      queue.flush();
+      return event;
+    }
+
+    void StagingRing::download(const ::cl::CommandQueue & queue,
+                               const ::cl::Buffer & buffer,
+                               void * data,
+                               std::size_t size,
+                               std::size_t offset,
+                               const std::vector<::cl::Event> * events) {
+      std::lock_guard<std::mutex> lock(mMutex);
+
+      auto destination = static_cast<char *>(data);
+      auto chunks = (size + mSlotBytes - 1) / mSlotBytes;
+      std::vector<Slot *> pending(chunks, nullptr);
+
+      auto enqueue = [&](std::size_t chunk) {
+        auto done = chunk * mSlotBytes;
+        auto & slot = acquire();
+        queue.enqueueReadBuffer(buffer,
+                                CL_FALSE,
+                                offset + done,
+                                std::min(mSlotBytes, size - done),
+                                slot.data,
+                                events,
+                                &slot.event);
+        pending[chunk] = &slot;
+      };
+
+      for (std::size_t chunk = 0; chunk < std::min(chunks, mSlots.size()); ++chunk) {
+        enqueue(chunk);
+      }
+      queue.flush();
+
+      for (std::size_t chunk = 0; chunk < chunks; ++chunk) {
+        auto & slot = *pending[chunk];
+        slot.event.wait();
+        slot.event = ::cl::Event();
+
+        auto done = chunk * mSlotBytes;
+        std::memcpy(destination + done, slot.data, std::min(mSlotBytes, size - done));
+
+        if (chunk + mSlots.size() < chunks) {
+          enqueue(chunk + mSlots.size());
+          queue.flush();
+        }
+      }
+    }
+  }
+}
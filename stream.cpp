@@ -0,0 +1,99 @@
+#include "include/mfl/cl/stream.hpp"
+
+#include <algorithm>
+
+namespace mfl {
+  namespace cl {
+
+    Stream::Stream(const ::cl::Context & context,
+                   const ::cl::Device & device,
+                   cl_command_queue_properties properties,
+                   std::size_t tileBytes,
+                   std::size_t outputBytes,
+                   std::size_t depth) :
+        mTileBytes(tileBytes),
+        mOutputBytes(outputBytes),
+        mUpload(context, device, properties),
+        mCompute(context, device, properties),
+        mDownload(context, device, properties),
+        mSlots(std::max<std::size_t>(depth, 1)) {
+      for (auto & slot : mSlots) {
+        slot.input = ::cl::Buffer(context, CL_MEM_READ_ONLY, tileBytes);
+        slot.output = ::cl::Buffer(context, CL_MEM_WRITE_ONLY, outputBytes);
+        slot.result.resize(outputBytes);
+        slot.busy = false;
+      }
+    }
+
+    void Stream::drain(Slot & slot, const StreamMerge & merge) {
+      if (!slot.busy) {
+        return;
+      }
+
+      slot.download.wait();
+      slot.busy = false;
+      merge(slot.tile, slot.result.data(), slot.bytes);
+    }
+
+    void Stream::run(std::size_t size,
+                     const StreamSource & source,
+                     const StreamKernel & kernel,
+                     const StreamMerge & merge) {
+      auto tiles = (size + mTileBytes - 1) / mTileBytes;
+
+      try {
+        for (std::size_t tile = 0; tile < tiles; ++tile) {
+          auto & slot = mSlots[tile % mSlots.size()];
+          drain(slot, merge);
+
+          auto offset = tile * mTileBytes;
+          auto bytes = std::min(mTileBytes, size - offset);
+          auto data = source(offset, bytes, slot.staging);
+
+          std::vector<::cl::Event> uploaded(1);
+          mUpload.enqueueWriteBuffer(slot.input, CL_FALSE, 0, bytes, data, nullptr, &uploaded[0]);
+
+          std::vector<::cl::Event> computed(1);
+          kernel(mCompute, slot.input, slot.output, tile, bytes, uploaded, computed[0]);
+
+          slot.tile = tile;
+          slot.bytes = bytes == mTileBytes
+                       ? mOutputBytes
+                       : static_cast<std::size_t>(double(mOutputBytes) * bytes / mTileBytes);
+          mDownload.enqueueReadBuffer(slot.output,
+                                      CL_FALSE,
+                                      0,
+                                      slot.bytes,
+                                      slot.result.data(),
+                                      &computed,
+                                      &slot.download);
+          slot.busy = true;
+
+          mUpload.flush();
+          mCompute.flush();
+          mDownload.flush();
+        }
+
+        for (std::size_t i = 0; i < mSlots.size(); ++i) {
+          drain(mSlots[(tiles + i) % mSlots.size()], merge);
+        }
+      } catch (...) {
+        abandon();
+        throw;
+      }
+    }
+
+    void Stream::abandon() {
+      for (auto queue : {&mUpload, &mCompute, &mDownload}) {
+        try {
+          queue->finish();
+        } catch (...) {
+        }
+      }
+
+      for (auto & slot : mSlots) {
+        slot.busy = false;
+      }
+    }
+  }
+}
@@ -0,0 +1,357 @@
+#include "include/mfl/cl/trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <mfl/exception.hpp>
+
+namespace mfl {
+  namespace cl {
+
+    namespace {
+      const std::uint32_t HOST = 1;
+      const std::uint32_t DEVICE = 2;
+
+      struct Span {
+        char name[40];
+        const char * category;
+        std::uint64_t start;
+        std::uint64_t end;
+        std::uint32_t process;
+        std::uint32_t track;
+      };
+
+      const std::size_t SPAN_WORDS = (sizeof(Span) + 7) / 8;
+
+      // A span stored as atomic words, so readers never race the writer.
+      // The sequence is odd while the span at an index is being written and
+      // even once it is complete
+      struct Slot {
+        std::atomic<std::uint64_t> sequence{0};
+        std::array<std::atomic<std::uint64_t>, SPAN_WORDS> words;
+      };
+
+      // Written only by the thread owning it. Readers keep the spans whose
+      // sequence matched their index before and after being copied. Rings
+      // of exited threads are handed to new ones, keeping their spans
+      struct Ring {
+        std::array<Slot, Trace::RING_SPANS> slots;
+        std::atomic<std::uint64_t> written{0};
+        std::atomic<std::uint64_t> cleared{0};
+        std::atomic<bool> owned{true};
+        std::uint32_t thread;
+      };
+
+      // Gives the ring back when its thread exits
+      struct RingOwner {
+        std::shared_ptr<Ring> ring;
+
+        ~RingOwner() {
+          if (ring) {
+            ring->owned.store(false, std::memory_order_release);
+          }
+        }
+      };
+
+      // Retains its queue, so the handle cannot be reused by another queue
+      // while the track is alive
+      struct QueueTrack {
+        ::cl::CommandQueue queue;
+        std::uint32_t id;
+        std::atomic<std::int64_t> offset{std::numeric_limits<std::int64_t>::max()};
+      };
+
+      struct DeviceCommand {
+        std::shared_ptr<QueueTrack> queue;
+        std::string name;
+      };
+
+      std::atomic<bool> enabledFlag(true);
+
+      std::mutex registryMutex;
+      std::vector<std::shared_ptr<Ring>> rings;
+      std::unordered_map<cl_command_queue, std::shared_ptr<QueueTrack>> queues;
+      // Outlive the tracks, since spans in the rings still name them
+      std::vector<std::string> queueNames;
+
+      thread_local RingOwner threadRing;
+      // Weak, so the threads do not keep released queues alive
+      thread_local std::unordered_map<cl_command_queue, std::weak_ptr<QueueTrack>> threadQueues;
+
+      Ring & ring() {
+        if (!threadRing.ring) {
+          std::lock_guard<std::mutex> lock(registryMutex);
+          for (auto & free : rings) {
+            bool owned = false;
+            if (free->owned.compare_exchange_strong(owned, true, std::memory_order_acquire)) {
+              threadRing.ring = free;
+              return *free;
+            }
+          }
+
+          threadRing.ring = std::make_shared<Ring>();
+          threadRing.ring->thread = static_cast<std::uint32_t>(rings.size() + 1);
+          rings.push_back(threadRing.ring);
+        }
+        return *threadRing.ring;
+      }
+
+      std::uint64_t complete(std::uint64_t index) {
+        return 2 * index + 2;
+      }
+
+      // False when the slot no longer, or not yet, holds the span at index
+      bool read(const Slot & slot, std::uint64_t index, Span & span) {
+        if (slot.sequence.load(std::memory_order_acquire) != complete(index)) {
+          return false;
+        }
+
+        std::uint64_t words[SPAN_WORDS];
+        for (std::size_t i = 0; i < SPAN_WORDS; ++i) {
+          words[i] = slot.words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != complete(index)) {
+          return false;
+        }
+
+        std::memcpy(&span, words, sizeof(Span));
+        return true;
+      }
+
+      void append(const char * category,
+                  const char * name,
+                  std::uint64_t start,
+                  std::uint64_t end,
+                  std::uint32_t process,
+                  std::uint32_t track) {
+        auto & target = ring();
+        auto index = target.written.load(std::memory_order_relaxed);
+        auto & slot = target.slots[index % Trace::RING_SPANS];
+
+        Span span;
+        std::memset(&span, 0, sizeof(span));
+        std::strncpy(span.name, name, sizeof(span.name) - 1);
+        span.category = category;
+        span.start = start;
+        span.end = end;
+        span.process = process;
+        span.track = process == HOST ? target.thread : track;
+
+        std::uint64_t words[SPAN_WORDS] = {};
+        std::memcpy(words, &span, sizeof(span));
+
+        slot.sequence.store(complete(index) - 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (std::size_t i = 0; i < SPAN_WORDS; ++i) {
+          slot.words[i].store(words[i], std::memory_order_relaxed);
+        }
+        slot.sequence.store(complete(index), std::memory_order_release);
+        target.written.store(index + 1, std::memory_order_release);
+      }
+
+      std::shared_ptr<QueueTrack> queueTrack(const ::cl::CommandQueue & queue) {
+        auto cached = threadQueues.find(queue());
+        if (cached != threadQueues.end()) {
+          if (auto track = cached->second.lock()) {
+            return track;
+          }
+        }
+
+        for (auto entry = threadQueues.begin(); entry != threadQueues.end();) {
+          entry = entry->second.expired() ? threadQueues.erase(entry) : std::next(entry);
+        }
+
+        std::shared_ptr<QueueTrack> track;
+        {
+          std::lock_guard<std::mutex> lock(registryMutex);
+          auto registered = queues.find(queue());
+          if (registered != queues.end()) {
+            track = registered->second;
+          } else {
+            // Tracks whose queue only they still hold belong to released
+            // queues
+            for (auto entry = queues.begin(); entry != queues.end();) {
+              entry = entry->second->queue.getInfo<CL_QUEUE_REFERENCE_COUNT>() == 1
+                      ? queues.erase(entry)
+                      : std::next(entry);
+            }
+
+            track = std::make_shared<QueueTrack>();
+            track->queue = queue;
+            track->id = static_cast<std::uint32_t>(queueNames.size() + 1);
+            queueNames.push_back("queue " + std::to_string(track->id) + " ("
+                + queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_NAME>() + ")");
+            queues.emplace(queue(), track);
+          }
+        }
+        threadQueues[queue()] = track;
+        return track;
+      }
+
+      void CL_CALLBACK completed(cl_event event, cl_int status, void * data) {
+        std::unique_ptr<DeviceCommand> command(static_cast<DeviceCommand *>(data));
+        auto host = static_cast<std::int64_t>(Trace::now());
+
+        cl_ulong start;
+        cl_ulong end;
+        if (status < 0
+            || clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr) != CL_SUCCESS
+            || clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr) != CL_SUCCESS) {
+          return;
+        }
+
+        auto & offset = command->queue->offset;
+        auto gap = host - static_cast<std::int64_t>(end);
+        auto current = offset.load();
+        while (gap < current && !offset.compare_exchange_weak(current, gap)) {
+        }
+        auto shift = std::min(gap, current);
+
+        append("device",
+               command->name.c_str(),
+               static_cast<std::uint64_t>(static_cast<std::int64_t>(start) + shift),
+               static_cast<std::uint64_t>(static_cast<std::int64_t>(end) + shift),
+               DEVICE,
+               command->queue->id);
+      }
+
+      void escape(std::ostream & out, const char * text) {
+        for (; *text; ++text) {
+          if (*text == '"' || *text == '\\') {
+            out << '\\';
+          }
+          if (static_cast<unsigned char>(*text) >= 0x20) {
+            out << *text;
+          }
+        }
+      }
+    }
+
+    bool Trace::enabled() {
+      return enabledFlag.load(std::memory_order_relaxed);
+    }
+
+    void Trace::setEnabled(bool enabled) {
+      enabledFlag = enabled;
+    }
+
+    std::uint64_t Trace::now() {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Trace::record(const char * category,
+                       const char * name,
+                       std::uint64_t start,
+                       std::uint64_t end) {
+      append(category, name, start, end, HOST, 0);
+    }
+
+    void Trace::recordDevice(const ::cl::CommandQueue & queue,
+                             const ::cl::Event & event,
+                             const std::string & name) {
+      if (!enabled()) {
+        return;
+      }
+
+      std::unique_ptr<DeviceCommand> command(new DeviceCommand{queueTrack(queue), name});
+      ::cl::Event(event).setCallback(CL_COMPLETE, &completed, command.get());
+      command.release();
+    }
+
+    void Trace::write(std::ostream & out) {
+      std::vector<std::shared_ptr<Ring>> snapshot;
+      std::vector<std::string> names;
+      {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        snapshot = rings;
+        names = queueNames;
+      }
+
+      std::vector<Span> spans;
+      for (auto & ring : snapshot) {
+        auto written = ring->written.load(std::memory_order_acquire);
+        auto first = std::max(ring->cleared.load(),
+                              written > RING_SPANS ? written - RING_SPANS : 0);
+        Span span;
+        for (auto index = first; index < written; ++index) {
+          if (read(ring->slots[index % RING_SPANS], index, span)) {
+            spans.push_back(span);
+          }
+        }
+      }
+
+      std::uint64_t origin = std::numeric_limits<std::uint64_t>::max();
+      std::set<std::pair<std::uint32_t, std::uint32_t>> tracks;
+      for (auto & span : spans) {
+        origin = std::min(origin, span.start);
+        tracks.emplace(span.process, span.track);
+      }
+
+      // Microseconds with nanosecond decimals, never in exponent form
+      auto flags = out.flags();
+      auto precision = out.precision();
+      out << std::fixed << std::setprecision(3);
+
+      out << "{\"traceEvents\": [\n";
+      out << "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": " << HOST
+          << ", \"args\": {\"name\": \"host\"}},\n";
+      out << "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": " << DEVICE
+          << ", \"args\": {\"name\": \"device\"}}";
+
+      for (auto & track : tracks) {
+        std::string name = "thread " + std::to_string(track.second);
+        if (track.first == DEVICE && track.second >= 1 && track.second <= names.size()) {
+          name = names[track.second - 1];
+        }
+
+        out << ",\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": " << track.first
+            << ", \"tid\": " << track.second << ", \"args\": {\"name\": \"";
+        escape(out, name.c_str());
+        out << "\"}}";
+      }
+
+      for (auto & span : spans) {
+        out << ",\n{\"ph\": \"X\", \"name\": \"";
+        escape(out, span.name);
+        out << "\", \"cat\": \"" << span.category
+            << "\", \"pid\": " << span.process
+            << ", \"tid\": " << span.track
+            << ", \"ts\": " << (span.start - origin) / 1000.0
+            << ", \"dur\": " << (span.end - span.start) / 1000.0 << "}";
+      }
+      out << "\n]}\n";
+
+      out.flags(flags);
+      out.precision(precision);
+    }
+
+    void Trace::dump(const std::string & path) {
+      std::ofstream file(path);
+      if (!file) {
+        throw mfl::Exception::build("Could not open {} for the trace", path);
+      }
+      write(file);
+    }
+
+    void Trace::clear() {
+      std::lock_guard<std::mutex> lock(registryMutex);
+      for (auto & ring : rings) {
+        ring->cleared = ring->written.load();
+      }
+    }
+  }
+}
@@ -0,0 +1,197 @@
+#include "include/mfl/cl/tracker.hpp"
+
+#include <algorithm>
+
+namespace mfl {
+  namespace cl {
+
+    namespace {
+      // Failed commands are not complete, so they stay in the wait lists
+      // and add() reports them
+      bool complete(const ::cl::Event & event) {
+        return event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+      }
+
+      void add(std::vector<::cl::Event> & wait, const ::cl::Event & event) {
+        if (!event()) {
+          return;
+        }
+
+        auto status = event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+        if (status < 0) {
+          throw ::cl::Error(status, "A command the buffer depends on failed");
+        }
+        if (status == CL_COMPLETE) {
+          return;
+        }
+
+        for (auto & other : wait) {
+          if (other() == event()) {
+            return;
+          }
+        }
+        wait.push_back(event);
+      }
+
+      template<typename T>
+      void addOnce(std::vector<T> & slots, const T & slot) {
+        if (slot && std::find(slots.begin(), slots.end(), slot) == slots.end()) {
+          slots.push_back(slot);
+        }
+      }
+    }
+
+    ::cl::Event DependencyTracker::track(const std::vector<std::string> & reads,
+                                         const std::vector<std::string> & writes,
+                                         const TrackedCommand & command) {
+      auto slot = std::make_shared<Slot>();
+      std::vector<std::shared_ptr<Slot>> after;
+
+      // Takes its place in the order first, so the command can be enqueued
+      // without holding the lock
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        for (auto & name : reads) {
+          auto hazards = mHazards.find(name);
+          if (hazards != mHazards.end()) {
+            addOnce(after, hazards->second.write);
+          }
+        }
+
+        for (auto & name : writes) {
+          auto hazards = mHazards.find(name);
+          if (hazards == mHazards.end()) {
+            continue;
+          }
+
+          if (hazards->second.reads.empty()) {
+            addOnce(after, hazards->second.write);
+          } else {
+            for (auto & read : hazards->second.reads) {
+              addOnce(after, read);
+            }
+          }
+        }
+
+        for (auto & name : reads) {
+          auto & hazards = mHazards[name];
+
+          // Readers pile up between writes; drop the finished ones
+          if (hazards.reads.size() >= 64) {
+            hazards.reads.erase(std::remove_if(hazards.reads.begin(),
+                                               hazards.reads.end(),
+                                               [](const std::shared_ptr<Slot> & read) {
+                                                 return read->enqueued
+                                                     && std::all_of(read->events.begin(),
+                                                                    read->events.end(),
+                                                                    complete);
+                                               }),
+                                hazards.reads.end());
+          }
+          hazards.reads.push_back(slot);
+        }
+
+        for (auto & name : writes) {
+          auto & hazards = mHazards[name];
+          hazards.write = slot;
+          hazards.reads.clear();
+        }
+      }
+
+      // A command failing to enqueue passes on what it would have waited
+      // for, so the order and any failure still hold for the ones after it
+      std::vector<::cl::Event> inherited;
+      try {
+        {
+          std::unique_lock<std::mutex> lock(mMutex);
+          for (auto & previous : after) {
+            mEnqueued.wait(lock, [&previous] {
+              return previous->enqueued;
+            });
+          }
+        }
+        for (auto & previous : after) {
+          inherited.insert(inherited.end(), previous->events.begin(), previous->events.end());
+        }
+
+        std::vector<::cl::Event> wait;
+        for (auto & event : inherited) {
+          add(wait, event);
+        }
+
+        auto done = command(wait);
+        publish(*slot, {done});
+        return done;
+      } catch (...) {
+        publish(*slot, std::move(inherited));
+        throw;
+      }
+    }
+
+    void DependencyTracker::publish(Slot & slot, std::vector<::cl::Event> events) {
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+        slot.events = std::move(events);
+        slot.enqueued = true;
+      }
+      mEnqueued.notify_all();
+    }
+
+    std::vector<::cl::Event> DependencyTracker::pending(const std::string & name) const {
+      std::unique_lock<std::mutex> lock(mMutex);
+
+      std::vector<std::shared_ptr<Slot>> slots;
+      auto hazards = mHazards.find(name);
+      if (hazards != mHazards.end()) {
+        addOnce(slots, hazards->second.write);
+        for (auto & read : hazards->second.reads) {
+          addOnce(slots, read);
+        }
+      }
+      for (auto & slot : slots) {
+        mEnqueued.wait(lock, [&slot] {
+          return slot->enqueued;
+        });
+      }
+      lock.unlock();
+
+      std::vector<::cl::Event> wait;
+      for (auto & slot : slots) {
+        for (auto & event : slot->events) {
+          add(wait, event);
+        }
+      }
+      return wait;
+    }
+
+    std::vector<::cl::Event> DependencyTracker::forget(const std::string & name) {
+      std::unique_lock<std::mutex> lock(mMutex);
+
+      std::vector<std::shared_ptr<Slot>> slots;
+      auto hazards = mHazards.find(name);
+      if (hazards == mHazards.end()) {
+        return {};
+      }
+      addOnce(slots, hazards->second.write);
+      for (auto & read : hazards->second.reads) {
+        addOnce(slots, read);
+      }
+      mHazards.erase(hazards);
+
+      std::vector<::cl::Event> events;
+      for (auto & slot : slots) {
+        mEnqueued.wait(lock, [&slot] {
+          return slot->enqueued;
+        });
+        events.insert(events.end(), slot->events.begin(), slot->events.end());
+      }
+      return events;
+    }
+
+    void DependencyTracker::clear() {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mHazards.clear();
+    }
+  }
+}
@@ -0,0 +1,77 @@
+#include "include/mfl/cl/tuner.hpp"
+
+#include <sstream>
+
+#include <mfl/exception.hpp>
+
+#include "include/mfl/cl/util.hpp"
+
+namespace mfl {
+  namespace cl {
+
+    // One entry per line: <local>\t<driver>\t<key>
+    TuningTable::TuningTable(const std::string & path) :
+        mPath(path) {
+      std::string data;
+      if (!util::readFile(path, data)) {
+        return;
+      }
+
+      std::istringstream stream(data);
+      std::string line;
+      while (std::getline(stream, line)) {
+        auto first = line.find('\t');
+        auto second = first == std::string::npos
+                      ? std::string::npos
+                      : line.find('\t', first + 1);
+        if (second == std::string::npos) {
+          continue;
+        }
+
+        try {
+          mEntries[line.substr(second + 1)] =
+              Entry{line.substr(first + 1, second - first - 1),
+                    std::stoul(line.substr(0, first))};
+        } catch (std::exception &) {
+        }
+      }
+    }
+
+    bool TuningTable::lookup(const std::string & key,
+                             const std::string & driver,
+                             std::size_t & local) const {
+      std::lock_guard<std::mutex> lock(mMutex);
+
+      auto entry = mEntries.find(key);
+      if (entry == mEntries.end() || entry->second.driver != driver) {
+        return false;
+      }
+
+      local = entry->second.local;
+      return true;
+    }
+
+    void TuningTable::store(const std::string & key,
+                            const std::string & driver,
+                            std::size_t local) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mEntries[key] = Entry{driver, local};
+      save();
+    }
+
+    void TuningTable::save() const {
+      std::string data;
+      for (auto & entry : mEntries) {
+        data += std::to_string(entry.second.local);
+        data += '\t';
+        data += entry.second.driver;
+        data += '\t';
+        data += entry.first;
+        data += '\n';
+      }
+      if (!util::writeFileAtomically(mPath, data)) {
+        throw mfl::Exception::build("Could not write {}", mPath);
+      }
+    }
+  }
+}